@@ -10,6 +10,11 @@
 
 #include "include/config.h"
 #include "include/aos_fs.h"
+#include "include/stats.h"
+
+/* The tracepoints of the module are defined here, once */
+#define CREATE_TRACE_POINTS
+#include "include/aos_trace.h"
 
 static int __init init_driver(void)
 {
@@ -25,6 +30,8 @@ static int __init init_driver(void)
     if (err) goto fail_fs;
     printk(KERN_INFO "%s: correctly registered AOS file system\n",MODNAME);
 
+    stats_init();
+
     return 0;
 
     fail_fs:
@@ -38,6 +45,8 @@ static void __exit exit_driver(void)
     int err;
     printk(KERN_INFO "%s: uninstalling device driver\n",MODNAME);
 
+    stats_exit();
+
     err = unregister_filesystem(&aos_fs_type);
 
     if (err) printk(KERN_ALERT "%s: failed to unregister file system driver (error %d)", MODNAME, err);
@@ -5,18 +5,21 @@
 #include <linux/syscalls.h>
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
 #include "lib/include/scth.h"
 
 #include "include/config.h"
 #include "include/aos_fs.h"
 #include "include/utils.h"
+#include "include/aos_trace.h"
 
 unsigned long the_syscall_table = 0x0;
 module_param(the_syscall_table, ulong, 0660);
 
 unsigned long the_ni_syscall;
 
-unsigned long new_sys_call_array[] = {0x0, 0x0, 0x0};   //please set to sys_vtpmo at startup
+unsigned long new_sys_call_array[] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};   //please set to sys_vtpmo at startup
 #define HACKED_ENTRIES (int)(sizeof(new_sys_call_array)/sizeof(unsigned long))
 int restore[HACKED_ENTRIES] = {[0 ... (HACKED_ENTRIES-1)] -1};
 
@@ -36,66 +39,64 @@ __SYSCALL_DEFINEx(2, _put_data, char *, source, size_t, size){
 asmlinkage int sys_put_data(char * source, size_t size){
 #endif
     struct aos_super_block aos_sb;
-    int nblocks, avb_size, fail;
-    uint64_t block_index, old_last;
+    struct buffer_head *bh;
+    int avb_size, fail, size_put;
+    uint64_t block_index = 0;
+    u64 start;
 
-    /* Check if device is mounted */
-    check_mount;
-
-    /* Signal device usage */
-    __sync_fetch_and_add(&info->counter, 1);
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+    start = lat_start();
 
     /* Check input parameter */
     aos_sb = info->sb;
     avb_size = aos_sb.data_block_size;
-    if (size+1 >= avb_size) {
+    if (size > avb_size) {
         fail = -EINVAL;
         goto failure_1;
     }
 
     /* Read bitmap to find a free block. Test and set: if a concurrent PUT retrieved the same block index, only
      * the first one to set the bit will be able to use it. The other one will try to find a new free block */
-    nblocks = aos_sb.partition_size;
-    do {
-        block_index = find_first_zero_bit(info->free_blocks, nblocks);
-        if(block_index == nblocks) { // no free block was found
-            fail = -ENOMEM;
-            goto failure_1;
-        }
-    } while (test_and_set_bit(block_index, info->free_blocks));
+    if (!reserve_blocks(&block_index, 1)) { // no free block was found
+        fail = -ENOMEM;
+        goto failure_1;
+    }
 
-    DEBUG { printk(KERN_DEBUG "%s: [put_data() - %d] Started on block %llu\n", MODNAME, current->pid, block_index); }
+    trace_put_start(block_index, size);
 
     /* Signal a pending PUT on selected block */
     set_bit(block_index, info->put_map);
 
-    /* Update last */
-    old_last = __atomic_exchange_n(&info->last, block_index, __ATOMIC_SEQ_CST);
-    DEBUG { printk(KERN_DEBUG "%s: [put_data() - %d] Atomically swapped 'last' from %llu to %llu. \n",
-                   MODNAME, current->pid, old_last, block_index); }
-
-    fail = put_new_block(block_index, source, size, old_last);
-    if (fail < 0) goto failure_2;
+    /* Write the message before joining the chain, so that no other PUT ever waits for the copy from user space */
+    size_put = put_payload(block_index, source, size, &bh);
+    if (size_put < 0) {
+        fail = size_put;
+        goto failure_2;
+    }
 
-    /* Signal completion of PUT operation on given block */
-    wake_on_bit(info->put_map, block_index) //clear_bit(block_index, info->put_map);
+    /* Append the block to the chain: the PUT completes once the block is published */
+    fail = put_new_chain(&block_index, &bh, 1);
+    if (fail < 0) goto failure_3;
 
     /* Release resources */
-    __sync_fetch_and_sub(&info->counter, 1);
-    wake_up_interruptible(&wq);
+    stat_inc(puts);
+    lat_end(LAT_PUT, start);
+    aos_put_device();
 
-    AUDIT { printk(KERN_INFO "%s: [put_data() - %d] Put %d bytes in block %llu\n", MODNAME, current->pid, fail, block_index); }
+    trace_put_done(block_index, size_put);
     return block_index;
 
     failure_2:
-        __sync_val_compare_and_swap(&info->last, block_index, old_last); // reset 'last' (if no thread has changed it)
-        clear_bit(block_index, info->free_blocks);
         wake_on_bit(info->put_map, block_index) //clear_bit(block_index, info->put_map);
+    failure_3:
+        free_block(block_index);
     failure_1:
-        __sync_fetch_and_sub(&info->counter, 1);
-        wake_up_interruptible(&wq);
+        stat_error(fail);
+        lat_end(LAT_PUT, start);
+        aos_put_device();
 
-        AUDIT { printk(KERN_INFO "%s: [put_data() - %d] Put failed on error %d\n", MODNAME, current->pid, fail); }
+        trace_put_done(block_index, fail);
         return fail;
 }
 
@@ -110,16 +111,12 @@ __SYSCALL_DEFINEx(3, _get_data, uint64_t, offset, char *, destination, size_t, s
 asmlinkage int sys_get_data(uint64_t offset, char * destination, size_t size){
 #endif
     struct aos_super_block aos_sb;
-    struct aos_data_block data_block;
-    int loaded_bytes, len, fail;
-    char * msg;
-    size_t ret;
-
-    /* Check if device is mounted */
-    check_mount;
+    int loaded_bytes, fail;
+    u64 start;
 
-    /* Signal device usage */
-    __sync_fetch_and_add(&info->counter, 1);
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+    start = lat_start();
 
     /* Check input parameters */
     aos_sb = info->sb;
@@ -128,41 +125,26 @@ asmlinkage int sys_get_data(uint64_t offset, char * destination, size_t size){
         goto failure;
     }
 
-    DEBUG { printk(KERN_DEBUG "%s: [get_data() - %d] Started on block %llu\n", MODNAME, current->pid, offset); }
-
-    /* Read given block */
-    fail = cpy_blk(info->vfs_sb, &info->block_locks[offset], offset, aos_sb.block_size, &data_block);
-    if (fail < 0) goto failure;
-
-    /* Check data validity */
-    if (!data_block.metadata.is_valid) {
-        fail = -ENODATA;
+    /* Try to read 'size' bytes of data starting from 'offset' into 'destination', if the block keeps valid data */
+    loaded_bytes = cpy_msg_to_user(info->vfs_sb, block_lock(offset), offset, destination, size);
+    if (loaded_bytes < 0) {
+        fail = loaded_bytes;
         goto failure;
     }
 
-    msg = data_block.data.msg;
-
-    /* Check message length */
-    len = strlen(msg);
-    if (len < size) size = len;
+    stat_inc(gets);
+    lat_end(LAT_GET, start);
+    aos_put_device();
 
-    /* Try to read 'size' bytes of data starting from 'offset' into 'destination' */
-    ret = (len == 0) ? 0 : copy_to_user(destination, msg, size);
-    loaded_bytes = size - ret;
-
-    __sync_fetch_and_sub(&info->counter, 1);
-    wake_up_interruptible(&wq);
-
-    AUDIT { printk(KERN_INFO "%s: [get_data() - %d] Read %d bytes in block %llu\n",
-                   MODNAME, current->pid, loaded_bytes, offset); }
+    trace_get(offset, size, loaded_bytes);
     return loaded_bytes;
 
 failure:
-    __sync_fetch_and_sub(&info->counter, 1);
-    wake_up_interruptible(&wq);
+    stat_error(fail);
+    lat_end(LAT_GET, start);
+    aos_put_device();
 
-    AUDIT { printk(KERN_INFO "%s: [get_data() - %d] Get on block %llu failed with error %d\n",
-                   MODNAME, current->pid, offset, fail); }
+    trace_get(offset, size, fail);
 
     return fail;
 }
@@ -177,12 +159,11 @@ __SYSCALL_DEFINEx(1, _invalidate_data, uint32_t, offset){
 asmlinkage int sys_invalidate_data(uint32_t offset){
 #endif
     int fail, nblocks;
+    u64 start;
 
-    /* Check if device is mounted */
-    check_mount;
-
-    /* Signal device usage */
-    __sync_fetch_and_add(&info->counter, 1);
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+    start = lat_start();
 
     /* Check input parameters */
     nblocks = info->sb.partition_size;
@@ -191,8 +172,6 @@ asmlinkage int sys_invalidate_data(uint32_t offset){
         goto failure_1;
     }
 
-    DEBUG { printk(KERN_DEBUG "%s: [invalidate_data() - %d] Started on block %d\n", MODNAME, current->pid, offset); }
-
     /* Signal a pending INV on selected block. Test and set is used to atomically detect concurrent invalidations
      * on the same block and stop them all except for the first to set the flag. */
     if (test_and_set_bit(offset, info->inv_map)) {
@@ -212,25 +191,653 @@ asmlinkage int sys_invalidate_data(uint32_t offset){
     if (fail < 0) goto failure_2;
 
     /* Finalize the invalidation: set invalid block as free to write on and release the bit in INV_MAP */
-    clear_bit(offset, info->free_blocks);
+    free_block(offset);
     clear_bit(offset, info->inv_map);
 
     /* Release resources */
-    __sync_fetch_and_sub(&info->counter, 1);
-    wake_up_interruptible(&wq);
+    stat_inc(invalidations);
+    lat_end(LAT_INV, start);
+    aos_put_device();
 
-    AUDIT { printk(KERN_INFO "%s: [invalidate_data() - %d] Invalidated block %d\n", MODNAME, current->pid, offset); }
+    trace_inv(offset, 0);
     return 0;
 
     /* Failures behaviour */
     failure_2:
         clear_bit(offset, info->inv_map);
     failure_1:
-        __sync_fetch_and_sub(&info->counter, 1);
-        wake_up_interruptible(&wq);
+        stat_error(fail);
+        lat_end(LAT_INV, start);
+        aos_put_device();
+
+        trace_inv(offset, fail);
+        return fail;
+}
+
+/**
+ * Put a batch of 'count' messages, described by the user-space 'vec' array, into as many free blocks of the device.
+ * The blocks are reserved with a single pass over the bitmap and appended to the chronological chain with a single
+ * splice, in the same order as the messages in 'vec'.
+ * Each message is put all or nothing; if PUT_VEC_ATOMIC is set in 'flags', the whole batch is put all or nothing.
+ * The outcome of each message is stored in the user-space 'offsets' array: the block index where it has been put
+ * or the (negative) error that prevented it.
+ * @return number of messages put on the device;
+ *         ENOMEM, if there is currently no room available on the device for any (or, if atomic, all) of them.
+ * */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(4, _put_data_vec, struct iovec *, vec, size_t, count, int64_t *, offsets, int, flags){
+#else
+asmlinkage int sys_put_data_vec(struct iovec * vec, size_t count, int64_t * offsets, int flags){
+#endif
+    struct iovec *kvec;
+    struct buffer_head **bhs;
+    uint64_t *blks;
+    int64_t *res;
+    int i, j, avb_size, nput, reserved, fail;
+
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+
+    /* Check input parameters */
+    if (!vec || !offsets || count == 0 || count > MAX_VEC) {
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    /* Allocate memory */
+    kvec = kmalloc_array(count, sizeof(struct iovec), GFP_KERNEL);
+    res = kmalloc_array(count, sizeof(int64_t), GFP_KERNEL);
+    blks = kmalloc_array(count, sizeof(uint64_t), GFP_KERNEL);
+    bhs = kmalloc_array(count, sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!kvec || !res || !blks || !bhs) {
+        fail = -ENOMEM;
+        goto failure_2;
+    }
+
+    if (copy_from_user(kvec, vec, count * sizeof(struct iovec))) {
+        fail = -EFAULT;
+        goto failure_2;
+    }
+
+    /* Check the size of each message: the ones that do not fit are discarded */
+    avb_size = info->sb.data_block_size;
+    nput = 0;
+    for (i = 0; i < count; ++i) {
+        if (kvec[i].iov_len > avb_size) {
+            res[i] = -EINVAL;
+            if (flags & PUT_VEC_ATOMIC) {
+                fail = -EINVAL;
+                goto failure_2;
+            }
+        } else {
+            res[i] = 0;
+            nput++;
+        }
+    }
+
+    if (nput == 0) {
+        fail = -EINVAL;
+        goto failure_2;
+    }
+
+    /* Reserve a free block for each valid message */
+    reserved = reserve_blocks(blks, nput);
+    if (reserved == 0 || (reserved < nput && (flags & PUT_VEC_ATOMIC))) {
+        release_blocks(blks, reserved);
+        fail = -ENOMEM;
+        goto failure_2;
+    }
+
+    /* Signal a pending PUT on the selected blocks */
+    for (j = 0; j < reserved; ++j) set_bit(blks[j], info->put_map);
+
+    /* Write the payloads. The blocks of the messages that fail are given back, keeping the other blocks in order */
+    nput = 0;
+    for (i = 0, j = 0; i < count; ++i) {
+        if (res[i] < 0) continue;
+        if (j == reserved) { // the device ran out of free blocks
+            res[i] = -ENOMEM;
+            continue;
+        }
+
+        fail = put_payload(blks[j], kvec[i].iov_base, kvec[i].iov_len, &bhs[nput]);
+        if (fail < 0) {
+            res[i] = fail;
+            wake_on_bit(info->put_map, blks[j])
+            free_block(blks[j]);
+            j++;
+
+            if (flags & PUT_VEC_ATOMIC) goto failure_3;
+            continue;
+        }
+
+        res[i] = blks[j];
+        blks[nput++] = blks[j++];
+    }
+
+    /* Append the written blocks to the chain: the PUT completes once the blocks are published */
+    if (nput > 0) {
+        fail = put_new_chain(blks, bhs, nput);
+        if (fail < 0) {
+            release_blocks(blks, nput);
+            goto failure_2;
+        }
+    }
+
+    fail = copy_to_user(offsets, res, count * sizeof(int64_t)) ? -EFAULT : nput;
+
+    /* Release resources */
+    kfree(kvec);
+    kfree(res);
+    kfree(blks);
+    kfree(bhs);
+    stat_add(puts, nput);
+    if (fail < 0) stat_error(fail);
+    aos_put_device();
+
+    trace_put_vec(count, fail);
+    return fail;
+
+    failure_3:
+        /* Atomic batch: give back every block reserved so far, both written and still unwritten */
+        for (i = 0; i < nput; ++i) brelse(bhs[i]);
+        for (i = 0; i < nput; ++i) { wake_on_bit(info->put_map, blks[i]) }
+        for (i = j; i < reserved; ++i) { wake_on_bit(info->put_map, blks[i]) }
+        release_blocks(blks, nput);
+        release_blocks(blks + j, reserved - j);
+    failure_2:
+        kfree(kvec);
+        kfree(res);
+        kfree(blks);
+        kfree(bhs);
+    failure_1:
+        stat_error(fail);
+        aos_put_device();
+
+        trace_put_vec(count, fail);
+        return fail;
+}
+
+/**
+ * Read the messages kept by 'count' blocks, whose offsets are given by the user-space 'offsets' array, into the
+ * 'destination' area of 'size' bytes. The messages are stored one after the other, in the same order as the offsets;
+ * a message that does not fit in the remaining space is truncated.
+ * The outcome of each offset is stored in the user-space 'lengths' array: the number of bytes loaded or the
+ * (negative) error of the single read (ENODATA, if no data is currently valid and associated with the offset).
+ * @return total number of bytes loaded into the destination area.
+ * */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(5, _get_data_vec, uint64_t *, offsets, size_t, count, char *, destination, size_t, size, int64_t *, lengths){
+#else
+asmlinkage int sys_get_data_vec(uint64_t * offsets, size_t count, char * destination, size_t size, int64_t * lengths){
+#endif
+    struct aos_super_block aos_sb;
+    uint64_t *koffsets;
+    int64_t *res;
+    size_t loaded_bytes;
+    int i, ret, fail, ngot = 0;
+
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+
+    /* Check input parameters */
+    aos_sb = info->sb;
+    if (!offsets || !lengths || !destination || count == 0 || count > MAX_VEC) {
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    /* Allocate memory */
+    koffsets = kmalloc_array(count, sizeof(uint64_t), GFP_KERNEL);
+    res = kmalloc_array(count, sizeof(int64_t), GFP_KERNEL);
+    if (!koffsets || !res) {
+        fail = -ENOMEM;
+        goto failure_2;
+    }
+
+    if (copy_from_user(koffsets, offsets, count * sizeof(uint64_t))) {
+        fail = -EFAULT;
+        goto failure_2;
+    }
+
+    loaded_bytes = 0;
+    for (i = 0; i < count; ++i) {
+        if (koffsets[i] < 2 || koffsets[i] >= aos_sb.partition_size) {
+            res[i] = -EINVAL;
+            continue;
+        }
+
+        /* Read the message into the space left in the destination area, if the block keeps valid data */
+        ret = cpy_msg_to_user(info->vfs_sb, block_lock(koffsets[i]), koffsets[i],
+                              destination + loaded_bytes, size - loaded_bytes);
+        res[i] = ret;
+        if (ret > 0) loaded_bytes += ret;
+        if (ret >= 0) ngot++;
+    }
+
+    fail = copy_to_user(lengths, res, count * sizeof(int64_t)) ? -EFAULT : loaded_bytes;
+
+    /* Release resources */
+    kfree(koffsets);
+    kfree(res);
+    stat_add(gets, ngot);
+    if (fail < 0) stat_error(fail);
+    aos_put_device();
+
+    trace_get_vec(count, fail);
+    return fail;
+
+    failure_2:
+        kfree(koffsets);
+        kfree(res);
+    failure_1:
+        stat_error(fail);
+        aos_put_device();
+
+        trace_get_vec(count, fail);
+        return fail;
+}
+
+/*
+ * Invalidates the 'n' blocks in 'blks' as a batch, skipping the ones that are concurrently invalidated or that do not
+ * keep valid data.
+ * @return the number of invalidated blocks; ENODATA if none of them kept valid data.
+ * */
+static int invalidate_batch(uint64_t *blks, int n){
+    int i, m, count;
+
+    /* Signal a pending INV on each block, dropping the ones that a single INV would fail on */
+    for (i = 0, m = 0; i < n; ++i) {
+        if (test_and_set_bit(blks[i], info->inv_map)) continue;
+
+        if (test_bit(blks[i], info->put_map) || !test_bit(blks[i], info->free_blocks)) {
+            clear_bit(blks[i], info->inv_map);
+            continue;
+        }
+
+        blks[m++] = blks[i];
+    }
+
+    count = (m > 0) ? invalidate_blocks(blks, m) : 0;
+
+    /* Finalize the invalidation: set invalid blocks as free to write on and release the bits in INV_MAP */
+    if (count > 0) release_blocks(blks, count);
+    for (i = 0; i < m; ++i) clear_bit(blks[i], info->inv_map);
+
+    return (count == 0) ? -ENODATA : count;
+}
+
+/**
+ * Invalidate data in the 'count' blocks whose offsets are given by the user-space 'offsets' array.
+ * Blocks that are neighbours in the chronological chain are removed together.
+ * @return number of invalidated blocks;
+ *         ENODATA error if no data is currently valid and associated with any of the offsets.
+ * */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(2, _invalidate_data_vec, uint64_t *, offsets, size_t, count){
+#else
+asmlinkage int sys_invalidate_data_vec(uint64_t * offsets, size_t count){
+#endif
+    uint64_t *blks;
+    int i, n, fail, nblocks;
+
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+
+    /* Check input parameters */
+    if (!offsets || count == 0 || count > MAX_VEC) {
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    blks = kmalloc_array(count, sizeof(uint64_t), GFP_KERNEL);
+    if (!blks) {
+        fail = -ENOMEM;
+        goto failure_1;
+    }
+
+    if (copy_from_user(blks, offsets, count * sizeof(uint64_t))) {
+        fail = -EFAULT;
+        goto failure_2;
+    }
+
+    /* Out of range offsets are skipped */
+    nblocks = info->sb.partition_size;
+    for (i = 0, n = 0; i < count; ++i) {
+        if (blks[i] >= 2 && blks[i] < nblocks) blks[n++] = blks[i];
+    }
+
+    fail = invalidate_batch(blks, n);
+    if (fail < 0) goto failure_2;
+
+    /* Release resources */
+    kfree(blks);
+    stat_add(invalidations, fail);
+    aos_put_device();
+
+    trace_inv_vec(count, fail);
+    return fail;
+
+    /* Failures behaviour */
+    failure_2:
+        kfree(blks);
+    failure_1:
+        stat_error(fail);
+        aos_put_device();
+
+        trace_inv_vec(count, fail);
+        return fail;
+}
+
+/**
+ * Invalidate data in every block with offset in ['lo', 'hi').
+ * Blocks that are neighbours in the chronological chain are removed together, in batches of MAX_VEC blocks at most
+ * so that the journal records of a batch always fit in the journal. The range is walked one batch at a time, so that
+ * the memory used does not grow with the size of the range.
+ * @return number of invalidated blocks;
+ *         ENODATA error if no data is currently valid in the given range.
+ * */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(2, _invalidate_range, uint64_t, lo, uint64_t, hi){
+#else
+asmlinkage int sys_invalidate_range(uint64_t lo, uint64_t hi){
+#endif
+    uint64_t *blks, blk;
+    int n, res, count, fail, nblocks;
+
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+
+    /* Check input parameters */
+    nblocks = info->sb.partition_size;
+    if (lo < 2 || hi > nblocks || lo >= hi) {
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    blks = kmalloc_array(MAX_VEC, sizeof(uint64_t), GFP_KERNEL);
+    if (!blks) {
+        fail = -ENOMEM;
+        goto failure_1;
+    }
+
+    fail = -ENODATA;
+    count = 0;
+    blk = lo;
+    while (blk < hi) {
+        /* Only the blocks in use can keep valid data: the next MAX_VEC of them make a batch */
+        for (n = 0, blk = find_next_bit(info->free_blocks, hi, blk); blk < hi && n < MAX_VEC;
+             blk = find_next_bit(info->free_blocks, hi, blk + 1)) {
+            blks[n++] = blk;
+        }
+        if (n == 0) break;
+
+        res = invalidate_batch(blks, n);
+        if (res > 0) {
+            count += res;
+        } else if (res != -ENODATA) {
+            fail = res;
+        }
+        cond_resched();
+    }
+    if (count == 0) goto failure_2;
+    fail = count;
+
+    /* Release resources */
+    kfree(blks);
+    stat_add(invalidations, count);
+    aos_put_device();
+
+    trace_inv_range(lo, hi, fail);
+    return fail;
+
+    /* Failures behaviour */
+    failure_2:
+        kfree(blks);
+    failure_1:
+        stat_error(fail);
+        aos_put_device();
+
+        trace_inv_range(lo, hi, fail);
+        return fail;
+}
+
+/**
+ * Completes an asynchronous PUT on behalf of a worker: the block, already written with the message at submission, is
+ * linked at the end of the chain like 'put_data' does. The result is stored in the slot of the PUT, to be reaped by
+ * 'put_data_reap', and the eventfd given at submission, if any, is signalled.
+ * */
+void async_put_work(struct work_struct *work){
+    struct aos_async_put *p = container_of(work, struct aos_async_put, work);
+    struct eventfd_ctx *efd = p->efd;
+    int64_t res;
+
+    res = put_new_chain(&p->blk, &p->bh, 1);
+    if (res < 0) {
+        free_block(p->blk);
+    } else {
+        res = p->blk;
+    }
+    p->res = res;
+
+    if (res < 0) {
+        stat_error(res);
+    } else {
+        stat_inc(puts);
+    }
+    trace_put_async_done(p->ticket, res);
+
+    /* From now on the slot can be reaped and reused: it must not be accessed anymore */
+    smp_store_release(&p->state, ASYNC_DONE);
+
+    if (efd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+        eventfd_signal(efd);
+#else
+        eventfd_signal(efd, 1);
+#endif
+        eventfd_ctx_put(efd);
+    }
+
+    aos_put_device();
+}
+
+/*
+ * Checks whether the process that submitted an asynchronous PUT is still running, so that it may reap its result.
+ * */
+static bool async_owner_alive(struct pid *owner){
+    bool alive;
+
+    rcu_read_lock();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+    alive = pid_task(owner, PIDTYPE_TGID) != NULL;
+#else
+    alive = pid_task(owner, PIDTYPE_PID) != NULL;
+#endif
+    rcu_read_unlock();
+
+    return alive;
+}
+
+/*
+ * Claims the slot 'p' of the ring for a new asynchronous PUT: a free slot, or a completed one whose result can never
+ * be reaped since the process that submitted its PUT is gone.
+ * @return true if the slot was claimed
+ * */
+static bool claim_async_slot(struct aos_async_put *p){
+    if (cmpxchg(&p->state, ASYNC_FREE, ASYNC_CLAIMED) != ASYNC_FREE) {
+        if (smp_load_acquire(&p->state) != ASYNC_DONE || async_owner_alive(p->owner)) return false;
+        if (cmpxchg(&p->state, ASYNC_DONE, ASYNC_CLAIMED) != ASYNC_DONE) return false;
+    }
+
+    put_pid(p->owner);
+    p->owner = NULL;
+
+    return true;
+}
+
+/**
+ * Submit the PUT of 'size' bytes of the user-space data identified by the 'source' pointer without waiting for it:
+ * the message is copied in a free block, which is handed to a kernel worker to be linked like 'put_data' does.
+ * On completion, the eventfd 'efd' is signalled (unless 'efd' is negative) and the result of the PUT (the block
+ * index or an error) can be reaped with 'put_data_reap', using the returned ticket, by the submitting process only.
+ * The results left behind by a process that exits without reaping them are dropped once their slots are needed.
+ * @return the ticket of the PUT;
+ *         EAGAIN, if too many PUTs are in flight or waiting to be reaped;
+ *         ENOMEM, if there is no free block.
+ * */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(3, _put_data_async, char *, source, size_t, size, int, efd){
+#else
+asmlinkage long sys_put_data_async(char * source, size_t size, int efd){
+#endif
+    struct aos_async_put *p;
+    uint64_t ticket;
+    long fail;
+
+    /* Signal device usage, unless the device is not mounted or being unmounted: the worker releases it once the PUT
+     * completes */
+    if (!aos_get_device()) return -ENODEV;
+
+    /* Check input parameter */
+    if (size > info->sb.data_block_size) {
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    /* Take a ticket and claim its slot in the ring: the slot is not seen as pending until its ticket is set */
+    ticket = __sync_add_and_fetch(&info->async_ticket, 1);
+    p = &info->async_ring[ticket % ASYNC_RING];
+    if (!claim_async_slot(p)) {
+        fail = -EAGAIN;
+        goto failure_1;
+    }
+
+    /* The message is copied straight in the block it is put in, the worker only has to link it */
+    if (!reserve_blocks(&p->blk, 1)) { // no free block was found
+        fail = -ENOMEM;
+        goto failure_2;
+    }
+
+    /* Signal a pending PUT on selected block */
+    set_bit(p->blk, info->put_map);
+
+    fail = put_payload(p->blk, source, size, &p->bh);
+    if (fail < 0) goto failure_3;
+
+    p->efd = NULL;
+    if (efd >= 0) {
+        p->efd = eventfd_ctx_fdget(efd);
+        if (IS_ERR(p->efd)) {
+            fail = PTR_ERR(p->efd);
+            goto failure_4;
+        }
+    }
+
+    /* Publish the ticket and the owner before the slot becomes pending: a concurrent reap never sees a pending slot
+     * with the ones of its previous PUT */
+    p->ticket = ticket;
+    p->owner = get_pid(task_tgid(current));
+    smp_store_release(&p->state, ASYNC_PENDING);
+    queue_work(info->async_wq, &p->work);
+
+    trace_put_async(ticket, size, ticket);
+    return ticket;
+
+    failure_4:
+        brelse(p->bh);
+    failure_3:
+        wake_on_bit(info->put_map, p->blk)
+        free_block(p->blk);
+    failure_2:
+        smp_store_release(&p->state, ASYNC_FREE);
+    failure_1:
+        stat_error(fail);
+        aos_put_device();
+
+        trace_put_async(0, size, fail);
+        return fail;
+}
+
+/**
+ * Reap the results of the asynchronous PUTs whose tickets are given by the user-space 'tickets' array.
+ * The result of each ticket is stored in the user-space 'results' array: the block index where the message was put,
+ * the error of the PUT, EINPROGRESS if the PUT has not completed yet, or EINVAL if the ticket is unknown, has
+ * already been reaped or was not submitted by the calling process. A reaped result frees the slot of its PUT.
+ * @return number of completed PUTs reaped.
+ * */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(3, _put_data_reap, uint64_t *, tickets, size_t, count, int64_t *, results){
+#else
+asmlinkage int sys_put_data_reap(uint64_t * tickets, size_t count, int64_t * results){
+#endif
+    struct aos_async_put *p;
+    uint64_t *ktickets;
+    int64_t *res, r;
+    int i, fail, reaped;
+
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
+
+    /* Check input parameters */
+    if (!tickets || !results || count == 0 || count > MAX_VEC) {
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    ktickets = kmalloc_array(count, sizeof(uint64_t), GFP_KERNEL);
+    res = kmalloc_array(count, sizeof(int64_t), GFP_KERNEL);
+    if (!ktickets || !res) {
+        fail = -ENOMEM;
+        goto failure_2;
+    }
+
+    if (copy_from_user(ktickets, tickets, count * sizeof(uint64_t))) {
+        fail = -EFAULT;
+        goto failure_2;
+    }
+
+    reaped = 0;
+    for (i = 0; i < count; ++i) {
+        p = &info->async_ring[ktickets[i] % ASYNC_RING];
+
+        switch (smp_load_acquire(&p->state)) {
+            case ASYNC_DONE:
+                r = p->res;
+                if (p->ticket == ktickets[i] && p->owner == task_tgid(current) &&
+                    cmpxchg(&p->state, ASYNC_DONE, ASYNC_FREE) == ASYNC_DONE) {
+                    res[i] = r;
+                    reaped++;
+                } else {
+                    res[i] = -EINVAL;
+                }
+                break;
+            case ASYNC_PENDING:
+                res[i] = (p->ticket == ktickets[i] && p->owner == task_tgid(current)) ? -EINPROGRESS : -EINVAL;
+                break;
+            default:
+                res[i] = -EINVAL;
+        }
+    }
+
+    fail = copy_to_user(results, res, count * sizeof(int64_t)) ? -EFAULT : reaped;
+
+    /* Release resources */
+    kfree(ktickets);
+    kfree(res);
+    aos_put_device();
+
+    trace_put_reap(count, fail);
+    return fail;
+
+    failure_2:
+        kfree(ktickets);
+        kfree(res);
+    failure_1:
+        stat_error(fail);
+        aos_put_device();
 
-        AUDIT { printk(KERN_INFO "%s: [invalidate_data() - %d] Invalidation of block %d failed with error %d.\n",
-                       MODNAME, current->pid, offset, fail); }
+        trace_put_reap(count, fail);
         return fail;
 }
 
@@ -238,6 +845,12 @@ asmlinkage int sys_invalidate_data(uint32_t offset){
 long sys_get_data = (unsigned long) __x64_sys_get_data;
 long sys_put_data = (unsigned long) __x64_sys_put_data;
 long sys_invalidate_data = (unsigned long) __x64_sys_invalidate_data;
+long sys_put_data_vec = (unsigned long) __x64_sys_put_data_vec;
+long sys_get_data_vec = (unsigned long) __x64_sys_get_data_vec;
+long sys_invalidate_data_vec = (unsigned long) __x64_sys_invalidate_data_vec;
+long sys_invalidate_range = (unsigned long) __x64_sys_invalidate_range;
+long sys_put_data_async = (unsigned long) __x64_sys_put_data_async;
+long sys_put_data_reap = (unsigned long) __x64_sys_put_data_reap;
 #else
 #endif
 
@@ -254,6 +867,12 @@ int register_syscalls()
     new_sys_call_array[0] = (unsigned long)sys_put_data;
     new_sys_call_array[1] = (unsigned long)sys_get_data;
     new_sys_call_array[2] = (unsigned long)sys_invalidate_data;
+    new_sys_call_array[3] = (unsigned long)sys_put_data_vec;
+    new_sys_call_array[4] = (unsigned long)sys_get_data_vec;
+    new_sys_call_array[5] = (unsigned long)sys_invalidate_data_vec;
+    new_sys_call_array[6] = (unsigned long)sys_invalidate_range;
+    new_sys_call_array[7] = (unsigned long)sys_put_data_async;
+    new_sys_call_array[8] = (unsigned long)sys_put_data_reap;
 
     ret = get_entries(restore,HACKED_ENTRIES,(unsigned long*)the_syscall_table,&the_ni_syscall);
 
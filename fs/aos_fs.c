@@ -4,10 +4,16 @@
 #include <linux/time.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/blkdev.h>
 #include <linux/version.h>
+#include <linux/log2.h>
 
 #include "../include/aos_fs.h"
 #include "../include/config.h"
+#include "../include/utils.h"
+#include "../include/journal.h"
+#include "../include/stats.h"
 
 /**
  * This module implements file system specific operations, such as the mount and unmount utilities and the function
@@ -23,55 +29,310 @@ static struct dentry_operations aos_de_ops = {
 aos_fs_info_t *info;
 uint64_t is_mounted = 0;
 
-static int init_fs_info(struct aos_super_block* aos_sb) {
+/*
+ * Loads the free blocks bitmap from its on-disk region. Read-ahead is issued for the whole region first, so that it is
+ * fetched with large sequential requests instead of one synchronous read per block.
+ * */
+static int load_bitmap(struct aos_super_block* aos_sb) {
+    struct buffer_head *bh;
+    uint64_t i, len, bytes = BITS_TO_LONGS(aos_sb->partition_size) * sizeof(long);
+
+    for (i = 0; i < aos_sb->bitmap_blocks; ++i) sb_breadahead(info->vfs_sb, aos_sb->bitmap_start + i);
+
+    for (i = 0; i < aos_sb->bitmap_blocks; ++i) {
+        bh = sb_bread(info->vfs_sb, aos_sb->bitmap_start + i);
+        if (!bh) return -EIO;
+
+        len = min_t(uint64_t, AOS_BLOCK_SIZE, bytes - i * AOS_BLOCK_SIZE);
+        memcpy((char *)info->free_blocks + i * AOS_BLOCK_SIZE, bh->b_data, len);
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/*
+ * Checks that the regions described by the superblock fit in the device: the bitmap region must have exactly the
+ * blocks needed to track the data blocks, and neither the bitmap nor the journal region may overlap the data blocks,
+ * each other or the end of the device. Otherwise, a crafted or corrupted superblock would make the bitmap copies
+ * overflow the in-memory bitmap.
+ * */
+static int check_regions(struct super_block *sb, struct aos_super_block *aos_sb) {
+    uint64_t bytes = BITS_TO_LONGS(aos_sb->partition_size) * sizeof(long);
+    uint64_t bitmap_end, journal_end, dev_blocks;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+    dev_blocks = bdev_nr_bytes(sb->s_bdev) / AOS_BLOCK_SIZE;
+#else
+    dev_blocks = i_size_read(sb->s_bdev->bd_inode) / AOS_BLOCK_SIZE;
+#endif
+
+    if (aos_sb->partition_size < 2 || aos_sb->bitmap_blocks != DIV_ROUND_UP(bytes, AOS_BLOCK_SIZE)) return -EINVAL;
+
+    /* Each region must start after the data blocks and end within the device, without overflows */
+    if (aos_sb->bitmap_start < aos_sb->partition_size || aos_sb->bitmap_start > dev_blocks ||
+        aos_sb->bitmap_blocks > dev_blocks - aos_sb->bitmap_start) return -EINVAL;
+    if (aos_sb->journal_start < aos_sb->partition_size || aos_sb->journal_start > dev_blocks ||
+        aos_sb->journal_blocks > dev_blocks - aos_sb->journal_start) return -EINVAL;
+
+    bitmap_end = aos_sb->bitmap_start + aos_sb->bitmap_blocks;
+    journal_end = aos_sb->journal_start + aos_sb->journal_blocks;
+    if (aos_sb->journal_start < bitmap_end && aos_sb->bitmap_start < journal_end) return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Rebuilds the summary bitmap from the free blocks bitmap
+ * */
+static void load_summary(int longs) {
+    int i;
+
+    bitmap_zero(info->full_words, longs);
+    for (i = 0; i < longs; ++i) {
+        if (info->free_blocks[i] == ~0UL) set_bit(i, info->full_words);
+    }
+}
+
+/*
+ * Called once the last user of the device is gone after the unmount dropped the reference of the mount
+ * */
+static void users_release(struct percpu_ref *ref) {
+    aos_fs_info_t *fs_info = container_of(ref, aos_fs_info_t, users);
+
+    complete(&fs_info->drained);
+}
+
+/*
+ * Initializes the 'info' structure. The state saved by the last checkpoint is brought up to date by the journal;
+ * if 'recover' is set, or the journal or the chain turn out to be inconsistent with the device, it is rebuilt from
+ * the metadata of the blocks instead.
+ * */
+static int init_fs_info(struct aos_super_block* aos_sb, bool recover) {
 
     int nblocks = aos_sb->partition_size;
     int longs = BITS_TO_LONGS(nblocks);     /* Number of unsigned longs needed to cover nblocks bits */
-    int i;
+    int i, ret = -ENOMEM;
+    ulong stripes;
 
     /* Allocate bitmaps */
-    info->free_blocks = kzalloc(longs * sizeof(long), GFP_KERNEL);
+    info->free_blocks = kvzalloc(longs * sizeof(long), GFP_KERNEL);
     if (!info->free_blocks) {
         printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate free blocks bitmap\n", MODNAME);
         goto fail_1;
     }
-    info->put_map = kzalloc(longs * sizeof(long), GFP_KERNEL);
+    info->put_map = kvzalloc(longs * sizeof(long), GFP_KERNEL);
     if (!info->put_map) {
         printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate PUT bitmap\n", MODNAME);
         goto fail_2;
     }
-    info->inv_map = kzalloc(longs * sizeof(long), GFP_KERNEL);
+    info->inv_map = kvzalloc(longs * sizeof(long), GFP_KERNEL);
     if (!info->inv_map) {
         printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate INVALIDATE bitmap\n", MODNAME);
         goto fail_3;
     }
 
-    /* Restore state information from the Superblock */
-    bitmap_or(info->free_blocks, info->free_blocks, aos_sb->padding, nblocks);
+    info->full_words = kzalloc(BITS_TO_LONGS(longs) * sizeof(long), GFP_KERNEL);
+    if (!info->full_words) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate summary bitmap\n", MODNAME);
+        goto fail_4;
+    }
+
+    info->cursors = alloc_percpu(struct aos_alloc_cursor);
+    info->stats = alloc_percpu(struct aos_stats);
+    if (!info->cursors || !info->stats) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate the per-CPU cursors and counters\n", MODNAME);
+        goto fail_5;
+    }
+
+    /* Restore state information from the Superblock and the bitmap region */
+    ret = load_bitmap(aos_sb);
+    if (ret < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't read the free blocks bitmap\n", MODNAME);
+        goto fail_5;
+    }
     info->first = aos_sb->first;
     info->last = aos_sb->last;
 
-    /* Init every seqlock associated to each block */
-    info->block_locks = kzalloc(nblocks * sizeof(seqlock_t), GFP_KERNEL);
+    /* Bring the state up to date with the updates logged in the journal since the last checkpoint */
+    ret = journal_load();
+    if (ret < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't read the journal\n", MODNAME);
+        goto fail_5;
+    }
+
+    if (!recover && journal_replay() < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't replay the journal, recovering from the blocks\n", MODNAME);
+        recover = true;
+    }
+
+    if (recover) {
+        ret = recover_state();
+        if (ret < 0) {
+            printk(KERN_ALERT "%s: [init_fs_info()] couldn't recover the device state\n", MODNAME);
+            goto fail_6;
+        }
+    }
+
+    load_summary(longs);
+
+    /* Init the seqlocks of the blocks, striped across the device: their number follows the CPUs that can contend
+     * them, not the size of the device */
+    stripes = min_t(ulong, roundup_pow_of_two(num_possible_cpus() * LOCK_STRIPES), roundup_pow_of_two(nblocks));
+    info->block_locks = kmalloc_array(stripes, sizeof(seqlock_t), GFP_KERNEL);
     if (!info->block_locks) {
         printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate seqlocks\n", MODNAME);
-        goto fail_4;
+        ret = -ENOMEM;
+        goto fail_6;
     }
 
-    for (i = 0; i < nblocks; ++i) { seqlock_init(&info->block_locks[i]); }
+    info->lock_mask = stripes - 1;
+    for (i = 0; i < stripes; ++i) { seqlock_init(&info->block_locks[i]); }
+
+    /* Init the queue of the synchronous PUTs */
+    spin_lock_init(&info->commit_lock);
+    INIT_LIST_HEAD(&info->commit_queue);
+    init_waitqueue_head(&info->commit_wq);
+    info->committing = false;
+
+    /* Build the in-memory mirror of the chronological chain */
+    info->chain = kvzalloc(nblocks * sizeof(struct aos_chain_entry), GFP_KERNEL);
+    if (!info->chain) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate the chain index\n", MODNAME);
+        ret = -ENOMEM;
+        goto fail_7;
+    }
+
+    ret = build_chain();
+    if (ret < 0 && !recover) {
+        printk(KERN_ALERT "%s: [init_fs_info()] the chain is corrupted, recovering from the blocks\n", MODNAME);
+        ret = recover_state();
+        if (ret >= 0) {
+            load_summary(longs);
+            ret = build_chain();
+        }
+    }
+    if (ret < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't build the chain index\n", MODNAME);
+        goto fail_8;
+    }
+
+    /* Init the ring and the workers of the asynchronous PUTs */
+    info->async_ring = kvcalloc(ASYNC_RING, sizeof(struct aos_async_put), GFP_KERNEL);
+    if (!info->async_ring) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate the asynchronous PUT ring\n", MODNAME);
+        ret = -ENOMEM;
+        goto fail_8;
+    }
+    info->async_ticket = 0;
+    for (i = 0; i < ASYNC_RING; ++i) INIT_WORK(&info->async_ring[i].work, async_put_work);
+
+    info->async_wq = alloc_workqueue("aos_put", WQ_UNBOUND, 0);
+    if (!info->async_wq) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate the asynchronous PUT workers\n", MODNAME);
+        ret = -ENOMEM;
+        goto fail_9;
+    }
+
+    ret = percpu_init_rwsem(&info->relink_sem);
+    if (ret < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate the relocation lock\n", MODNAME);
+        goto fail_10;
+    }
+
+    /* The mount holds the first reference on the device, dropped by the unmount */
+    init_completion(&info->drained);
+    ret = percpu_ref_init(&info->users, users_release, 0, GFP_KERNEL);
+    if (ret < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't allocate the usage count\n", MODNAME);
+        goto fail_11;
+    }
+
+    /* Save the replayed state, so that the journal starts over from its next record */
+    ret = journal_checkpoint();
+    if (ret < 0) {
+        printk(KERN_ALERT "%s: [init_fs_info()] couldn't checkpoint the journal\n", MODNAME);
+        goto fail_12;
+    }
+    schedule_delayed_work(&info->journal.ckpt_work, msecs_to_jiffies(CHECKPOINT_INTERVAL));
 
     info->vfs_sb->s_fs_info = info;
 
     return 0;
 
+    fail_12:
+        percpu_ref_exit(&info->users);
+    fail_11:
+        percpu_free_rwsem(&info->relink_sem);
+    fail_10:
+        destroy_workqueue(info->async_wq);
+    fail_9:
+        kvfree(info->async_ring);
+    fail_8:
+        kvfree(info->chain);
+    fail_7:
+        kfree(info->block_locks);
+    fail_6:
+        journal_free();
+    fail_5:
+        free_percpu(info->stats);
+        free_percpu(info->cursors);
+        kfree(info->full_words);
     fail_4:
-        kfree(info->inv_map);
+        kvfree(info->inv_map);
     fail_3:
-        kfree(info->put_map);
+        kvfree(info->put_map);
     fail_2:
-        kfree(info->free_blocks);
+        kvfree(info->free_blocks);
     fail_1:
-        return -ENOMEM;
+        return ret;
+}
+
+/*
+ * Releases every structure allocated by 'init_fs_info'
+ * */
+static void free_fs_info(void) {
+    int i;
+
+    stats_unregister();
+    cancel_delayed_work_sync(&info->journal.ckpt_work);
+    percpu_ref_exit(&info->users);
+    percpu_free_rwsem(&info->relink_sem);
+    destroy_workqueue(info->async_wq);
+    for (i = 0; i < ASYNC_RING; ++i) put_pid(info->async_ring[i].owner);
+    kvfree(info->async_ring);
+    kvfree(info->chain);
+    kfree(info->block_locks);
+    journal_free();
+    free_percpu(info->stats);
+    free_percpu(info->cursors);
+    kfree(info->full_words);
+    kvfree(info->inv_map);
+    kvfree(info->put_map);
+    kvfree(info->free_blocks);
+}
+
+/*
+ * Parses the mount options in 'data'. The only option is "recover", which rebuilds the device state from the metadata
+ * of the blocks instead of trusting the superblock and the journal.
+ * @return 0 on success; EINVAL on an unknown option
+ * */
+static int parse_options(char *data, bool *recover) {
+    char *opt;
+
+    *recover = false;
+    while ((opt = strsep(&data, ",")) != NULL) {
+        if (!*opt) continue;
+
+        if (!strcmp(opt, "recover")) {
+            *recover = true;
+        } else {
+            printk(KERN_ALERT "%s: [parse_options()] unknown mount option '%s'\n", MODNAME, opt);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
 }
 
 /**
@@ -79,14 +340,20 @@ static int init_fs_info(struct aos_super_block* aos_sb) {
  * struct super_block structure fields and the initialization of the root directory inode.
  * The maximum number of manageable blocks is a parameter NBLOCKS that can be configured at compile time.
  * If a block-device layout keeps more than NBLOCKS blocks, the mount operation of the device should fail.
+ * The free blocks bitmap is loaded from its own region, so its size does not depend on the superblock.
+ * With the "recover" mount option, the state is rebuilt from the metadata of the blocks by a parallel scan of the device.
  * */
 static int aos_fill_super(struct super_block *sb, void *data, int silent) {
 
     struct inode *root_inode;
     struct buffer_head *bh;
     struct timespec64 curr_time;
+    bool recover;
     int fail;
 
+    fail = parse_options(data, &recover);
+    if (fail) return fail;
+
     /* Set block size */
     if(!sb_set_blocksize(sb, AOS_BLOCK_SIZE)) {
         printk(KERN_ALERT "%s: [aos_fill_super()] couldn't set the block size in the vfs superblock\n", MODNAME);
@@ -119,16 +386,40 @@ static int aos_fill_super(struct super_block *sb, void *data, int silent) {
         goto failure_1;
     }
 
+    /* Check layout version and size */
+    if(info->sb.version != AOS_VERSION) {
+        printk(KERN_ALERT "%s: [aos_fill_super()] unsupported layout version %llu. abort mounting.\n",
+               MODNAME, info->sb.version);
+
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    if(info->sb.partition_size > NBLOCKS) {
+        printk(KERN_ALERT "%s: [aos_fill_super()] the device exceeds the maximum number of manageable blocks. "
+                          "abort mounting.\n", MODNAME);
+
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
+    if(check_regions(sb, &info->sb) < 0) {
+        printk(KERN_ALERT "%s: [aos_fill_super()] the bitmap or journal region lies out of the device. "
+                          "abort mounting.\n", MODNAME);
+
+        fail = -EINVAL;
+        goto failure_1;
+    }
+
     /* Fill superblock */
     sb->s_magic = MAGIC;
     sb->s_type = &aos_fs_type;
     sb->s_op = &aos_sb_ops;
 
     info->vfs_sb = sb;
-    if(init_fs_info(&info->sb)) {
+    fail = init_fs_info(&info->sb, recover);
+    if(fail) {
         printk(KERN_ALERT "%s: [aos_fill_super()] couldn't initialize aos_fs_info structure\n", MODNAME);
-
-        fail = -ENOMEM;
         goto failure_1;
     }
 
@@ -172,6 +463,8 @@ static int aos_fill_super(struct super_block *sb, void *data, int silent) {
     }
     sb->s_root->d_op = &aos_de_ops;
 
+    stats_register();
+
     is_mounted = 1;
 
     // unlock the inode to make it usable
@@ -180,51 +473,32 @@ static int aos_fill_super(struct super_block *sb, void *data, int silent) {
     return 0;
 
 failure_2:
-    kfree(info->free_blocks);
-    kfree(info->put_map);
-    kfree(info->inv_map);
-    kfree(info->block_locks);
+    free_fs_info();
 failure_1:
     kfree(info);
     return fail;
 }
 
 static void aos_kill_superblock(struct super_block *sb){
-    struct buffer_head *bh;
-    struct aos_super_block *aos_sb;
-    int trials = 0;
 
     /* Atomically set the device as unmounted, to stop every new thread trying to access the device */
     __atomic_store_n(&is_mounted, 0, __ATOMIC_RELAXED);
 
-    /* Wait for every thread already in the device to complete */
-    while (info->counter && trials < SYSCALL_TRIALS) {
-        wait_event_interruptible_timeout(wq, (info->counter == 0), msecs_to_jiffies(JIFFIES));
-        printk(KERN_INFO "%s: waiting to unmount...\n", MODNAME);
-        trials++;
-    }
+    /* Wake up the readers waiting for new messages */
+    wake_up_interruptible_all(&info->chain_wq);
 
-    /* Read superblock */
-    bh = sb_bread(sb, SUPER_BLOCK_IDX);
-    if(!bh) {
-        printk(KERN_ALERT "%s: [aos_kill_super()] couldn't save device info in the vfs superblock\n", MODNAME);
-        goto failure;
-    }
-    aos_sb = (struct aos_super_block*)bh->b_data;
-    /* Save FS info */
-    aos_sb->first = info->first;
-    aos_sb->last = info->last;
-    memcpy(aos_sb->padding, info->free_blocks, BITS_TO_BYTES(aos_sb->partition_size));
+    /* Drop the reference of the mount and wait for every thread already in the device, and every asynchronous PUT
+     * already submitted, to complete: no new one can get in once the reference is killed */
+    percpu_ref_kill(&info->users);
+    wait_for_completion(&info->drained);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    /* Stop the periodic checkpoints and save the final state: the next mount has nothing to replay */
+    cancel_delayed_work_sync(&info->journal.ckpt_work);
+    if (journal_checkpoint() < 0) {
+        printk(KERN_ALERT "%s: [aos_kill_super()] couldn't save device info in the superblock\n", MODNAME);
+    }
 
-failure:
-    kfree(info->free_blocks);
-    kfree(info->put_map);
-    kfree(info->inv_map);
-    kfree(info->block_locks);
+    free_fs_info();
     kfree(info);
 
     kill_block_super(sb);
@@ -7,7 +7,7 @@
 
 #include "../include/aos_fs.h"
 
-int print_superblock(int fd, int *d_blocks){
+int print_superblock(int fd, int *d_blocks, int *b_blocks){
     ssize_t ret;
     struct aos_super_block aos_sb;
 
@@ -19,14 +19,23 @@ int print_superblock(int fd, int *d_blocks){
 
     printf("Superblock: \n");
     printf("\tmagic: %lx\n", aos_sb.magic);
+    printf("\tversion: %lu\n", aos_sb.version);
     printf("\tblock size: %lu\n", aos_sb.block_size);
     printf("\tdata block size: %lu\n", aos_sb.data_block_size);
     printf("\tpartition size: %lu\n", aos_sb.partition_size);
     printf("\tfirst: %lu\n", aos_sb.first);
     printf("\tlast: %lu\n", aos_sb.last);
-    printf("\tfree blocks: %lx\n", aos_sb.padding[0]);
+    printf("\tbitmap region: %lu blocks from block %lu\n", aos_sb.bitmap_blocks, aos_sb.bitmap_start);
+    printf("\tjournal region: %lu blocks from block %lu\n", aos_sb.journal_blocks, aos_sb.journal_start);
+    printf("\tjournal replay from record: %lu\n", aos_sb.journal_seq);
+
+    if (aos_sb.version != AOS_VERSION) {
+        printf("Unsupported layout version (expected %d).\n", AOS_VERSION);
+        return -1;
+    }
 
     *d_blocks = aos_sb.partition_size-2;
+    *b_blocks = aos_sb.bitmap_blocks;
     return 0;
 }
 
@@ -76,14 +85,34 @@ int print_data_blocks(int fd, int nblocks){
         printf("\tis valid: %lu\n", aos_block.metadata.is_valid);
         printf("\tprev: %lu\n", aos_block.metadata.prev);
         printf("\tnext: %lu\n", aos_block.metadata.next);
+        printf("\tlength: %lu\n", aos_block.metadata.length);
     }
 
     return 0;
 }
 
+int print_bitmap(int fd, int nblocks, int bblocks){
+    ssize_t ret;
+    ulong block[AOS_BLOCK_SIZE/sizeof(ulong)];
+    int i, j, used = 0;
+
+    for (i = 0; i < bblocks; ++i) {
+        ret = read(fd, (char*)block, AOS_BLOCK_SIZE);
+        if (ret != AOS_BLOCK_SIZE){
+            printf("Bitmap block [%d]: read [%d] bytes.\n", i, (int)ret);
+            return -1;
+        }
+        if (i == 0) printf("Free blocks bitmap: \n\tfirst word: %lx\n", block[0]);
+        for (j = 0; j < AOS_BLOCK_SIZE/sizeof(ulong); ++j) used += __builtin_popcountl(block[j]);
+    }
+
+    printf("\tblocks in use: %d of %d\n", used, nblocks+2);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    int fd, d_blocks;
+    int fd, d_blocks, b_blocks;
 
     if (argc != 2) {
         printf("Usage: debug_fs <device>\n");
@@ -96,7 +125,7 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if(print_superblock(fd, &d_blocks) == -1) {
+    if(print_superblock(fd, &d_blocks, &b_blocks) == -1) {
         close(fd);
         return EXIT_FAILURE;
     }
@@ -111,6 +140,11 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if(print_bitmap(fd, d_blocks, b_blocks) == -1){
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
     close(fd);
     return 0;
 }
@@ -6,32 +6,49 @@
 #include <linux/types.h>
 #include <linux/string.h>
 #include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/blkdev.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
 
+#include "../include/config.h"
 #include "../include/aos_fs.h"
 #include "../include/utils.h"
+#include "../include/aos_trace.h"
 
 /**
  * The device driver should support file system operations allowing the access to the currently saved data:
  *  - 'open' for opening the device as a simple stream of bytes
  *  - 'release' for closing the file associated with the device
- *  - 'read' to access the device file content, according to the order of the delivery of data.
+ *  - 'read' to access the device file content, according to the order of the delivery of data, also through
+ *    'splice' and 'sendfile' towards pipes and sockets.
+ * Once the end of the chain is reached, a read returns the messages delivered afterwards, if any: 'poll' signals when
+ * there are new messages to read and, in follow mode (AOS_IOC_FOLLOW), reads block until a new message is delivered.
  * When the device is not mounted, the above file operations should simply return with error.
  */
 
 extern aos_fs_info_t *info;
 
+/* Number of blocks following the current one along the chain that 'aos_read_iter' keeps requested from the device */
+unsigned int read_ahead = READ_AHEAD;
+module_param(read_ahead, uint, 0660);
+
 /*
  * Opens the device
  * */
 int aos_open(struct inode *inode, struct file *filp){
 
-    /* Check if device is mounted */
-    check_mount;
+    /* Signal device usage, unless the device is not mounted or being unmounted */
+    if (!aos_get_device()) return -ENODEV;
 
-    /* Signal device usage */
-    __sync_fetch_and_add(&info->counter, 1);
+    filp->private_data = kzalloc(sizeof(struct aos_file), GFP_KERNEL);
+    if (!filp->private_data) {
+        aos_put_device();
+        return -ENOMEM;
+    }
 
-    printk(KERN_INFO "%s: device file successfully opened by thread %d\n", MODNAME, current->pid);
+    trace_open(filp->f_flags);
 
     return 0;
 }
@@ -41,115 +58,221 @@ int aos_open(struct inode *inode, struct file *filp){
  * */
 int aos_release(struct inode *inode, struct file *filp){
 
-    filp->f_pos = 0;
+    trace_release(filp->f_pos);
 
-    // atomic sub to usage counter
-    __sync_fetch_and_sub(&(info->counter), 1);
-    wake_up_interruptible(&wq);
+    filp->f_pos = 0;
+    kfree(filp->private_data);
 
-    printk(KERN_INFO "%s: device file closed by thread %d\n",MODNAME, current->pid);
+    aos_put_device();
 
     return 0;
 }
 
 /*
- * Reads 'count' bytes from the device starting from the oldest message; the value *f_pos (which usually corresponds to
- * the file pointer) is ignored.
+ * Returns the block where a read with file pointer 'pos' starts: the oldest block for a new session, the successor of
+ * the last block read once the end of the chain was reached, or the block kept by the file pointer otherwise.
+ * @return the index of the block; 0 if there is nothing to read
+ * */
+static loff_t first_to_read(struct aos_file *af, loff_t pos){
+    if (pos == 0) return chain_next(0);
+    if ((pos >> 32) == info->sb.partition_size) return chain_next_seq(af->seq);
+    return pos >> 32;
+}
+
+/*
+ * Requests from the device up to 'n' blocks following '*from' along the in-memory chain, in a single plug, without
+ * waiting for them. '*from' is moved to the last block requested.
+ * @return the number of blocks requested
+ * */
+static unsigned int readahead_chain(loff_t *from, unsigned int n){
+    struct blk_plug plug;
+    unsigned int i;
+    loff_t blk;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < n; ++i) {
+        blk = chain_next(*from);
+        if (blk == 0) break;
+
+        sb_breadahead(info->vfs_sb, blk);
+        *from = blk;
+    }
+    blk_finish_plug(&plug);
+
+    return i;
+}
+
+/*
+ * Reads up to the size of 'to' bytes from the device starting from the oldest message, into the iterator 'to', which
+ * can be a user buffer as well as the pages of a pipe for 'splice_read' and 'sendfile'. The value iocb->ki_pos (which
+ * usually corresponds to the file pointer) keeps the position reached along the chain.
  * The content must be delivered chronologically and the operation should only return data related to messages
  * not invalidated before the access in read mode to the corresponding block of the device in an I/O session.
+ * Each message is copied straight from the buffer cache into the iterator, without an intermediate kernel buffer, so
+ * that the size of a read is not limited and no memory is allocated: a message cut at the end of 'to' is resumed from
+ * the same byte by the next read.
  * */
-ssize_t aos_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+ssize_t aos_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
-    struct aos_super_block aos_sb;
-    struct aos_data_block data_block;
-    int len, ret, data_block_size, bytes_read;
-    bool is_last;
-    char *msg, *block_msg;
-    loff_t b_idx, offset, nblocks, next;
+    struct file *filp = iocb->ki_filp;
+    struct aos_file *af = filp->private_data;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count, length, bytes_read;
+    int ret;
+    bool is_last = false;
+    loff_t b_idx, offset, nblocks, next, ra_blk;
+    unsigned int ra_window, ra_left;
+    u64 start;
 
-    /* Check device state validity: if 'last' is 1, the device is empty */
-    if (info->first == 0 || info->last == 1) return -ENODATA;
+    /* Check device state validity: if the in-memory chain is empty, the device is empty */
+    if (!af->follow && chain_next(0) == 0) return -ENODATA;
 
     /* Retrieve device info */
-    aos_sb = info->sb;
-    nblocks = aos_sb.partition_size;
-    data_block_size = aos_sb.data_block_size;
-
-    /* If the offset was set at NBLOCKS, then EOF is reached */
-    if ((*f_pos >> 32) == nblocks) return 0;
+    nblocks = info->sb.partition_size;
 
     /* Check parameter validity */
+    count = iov_iter_count(to);
     if (!count) return 0;
-    if (!buf) return -EINVAL;
 
-    /* Allocate memory */
-    if (count > MAX_READ) { count = MAX_READ; }
-    msg = kzalloc(count, GFP_KERNEL);
-    if(!msg) return -ENOMEM;
+    /* If EOF was reached, only the messages delivered afterwards are read; in follow mode, wait for one */
+    while ((b_idx = first_to_read(af, *f_pos)) == 0) {
+        if (!af->follow) return 0;
+        if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
 
-    /* Parse file pointer */
-    b_idx = (*f_pos == 0) ? info->first : (*f_pos >> 32);   // retrieve last block accessed by the current thread (high 32 bits)
+        if (wait_event_interruptible(info->chain_wq, !is_mounted || first_to_read(af, *f_pos) != 0))
+            return -ERESTARTSYS;
+        check_mount;
+    }
+
+    /* Parse file pointer: the last block accessed by the current thread (high 32 bits) was retrieved above */
     offset = *f_pos & 0x00000000ffffffff; // retrieve last byte accessed by the current thread (low 32 bits)
 
-    AUDIT { printk(KERN_INFO "%s: read operation called by thread %d - fp is (%lld, %lld)\n",
-           MODNAME, current->pid, b_idx, offset); }
+    trace_read_start(b_idx, offset, count);
+    start = lat_start();
 
-    bytes_read = 0;
-    while((bytes_read < count) && (!is_last)){
-        is_last = (b_idx == info->last);
+    /* The readahead window is refilled once half of it has been consumed, so that the next blocks are already
+     * in flight while the current ones are copied */
+    ra_window = READ_ONCE(read_ahead);
+    ra_blk = b_idx;
+    ra_left = 0;
 
-        /* Read data block into a local variable */
-        ret = cpy_blk(info->vfs_sb, &info->block_locks[b_idx], b_idx, data_block_size, &data_block);
-        if (ret < 0) {
-            kfree(msg);
-            return ret;
-        }
-
-        next = data_block.metadata.next;
+    bytes_read = 0;
+    while(bytes_read < count){
+        if (ra_window && ra_left <= ra_window / 2) ra_left += readahead_chain(&ra_blk, ra_window - ra_left);
 
-        /* Check data validity: invalidation could happen while reading the block.
+        /* Copy the message from the file pointer offset: invalidation could happen while reading the block.
          * This ensures that a writing on the block is always detected, even if the read is already executing. */
-        if (!data_block.metadata.is_valid) {
-            if (next == 0) break;
-            b_idx = next;
-            offset = 0; // reset intra-block offset
-            continue;
+        ret = cpy_msg_to_iter(info->vfs_sb, block_lock(b_idx), b_idx, offset, count - bytes_read, to, &length);
+        if (ret == -EIO || ret == -EFAULT) {
+            stat_error(ret);
+            if (bytes_read == 0) return ret;
+            break; // what was copied is returned: the file pointer is left on the block, to be retried
         }
 
-        /* Use the file pointer offset to start reading from given position in the file */
-        block_msg = (offset != 0) ? data_block.data.msg + offset : data_block.data.msg;
-        len = strlen(block_msg);
+        /* The successor is taken from the in-memory chain, which links valid blocks only */
+        next = chain_next(b_idx);
 
-        AUDIT { printk(KERN_DEBUG "%s: read operation accessed block %lld of the device\n", MODNAME, b_idx); }
+        trace_read_hop(b_idx, ret);
 
-        if ((bytes_read + len) > count) { // last block to read
-            len = count - bytes_read;
-            memcpy(msg + bytes_read, block_msg, len);
-            bytes_read += len;
-            offset += len;
+        if (ret >= 0) { // ENODATA: the block was invalidated and is skipped
+            bytes_read += ret;
+            offset += ret;
+            if (offset < length || bytes_read == count) break; // last block to read: no room left for the separator
 
-            break;
+            if (copy_to_iter("\n", 1, to) != 1) break;
+            bytes_read += 1;
         }
 
-        memcpy(msg + bytes_read, block_msg, len);
-        bytes_read += len;
-        memcpy(msg + bytes_read, "\n", 1);
-        bytes_read += 1;
+        if (next == 0) {
+            is_last = true;
+            break;
+        }
 
-        if (next == 0) break;
+        /* Reset intra-block offset, unless the message was relocated to 'next' by a compaction while being read: it
+         * keeps its publication order, and is resumed from the same byte at its new position */
+        if (ret != -ENODATA || chain_seq(next) != chain_seq(b_idx)) offset = 0;
         b_idx = next;
-        offset = 0; // reset intra-block offset
-    }
+        if (ra_left) ra_left--;
 
-    ret = (bytes_read > 0) ? copy_to_user(buf, msg, bytes_read) : 0;
-    kfree(msg);
+        /* A large read goes through many blocks without sleeping, unless they have to be read from the device */
+        if (fatal_signal_pending(current)) break;
+        cond_resched();
+    }
 
-    // set high 32 bits of f_pos to the current index i and low 32 bits of f_pos to the new offset count
+    // set high 32 bits of f_pos to the current index i and low 32 bits of f_pos to the new offset count.
+    // At EOF the publication order of the last block is kept, to resume from the messages delivered afterwards
+    if (is_last) af->seq = chain_seq(b_idx);
     *f_pos = (is_last) ? (nblocks << 32) : (b_idx << 32) | offset;
 
-    AUDIT { printk(KERN_INFO "%s: read operation by thread %d completed\n", MODNAME, current->pid); }
+    stat_inc(reads);
+    lat_end(LAT_READ, start);
+    trace_read_done(bytes_read);
 
-    return (bytes_read - ret);
+    return bytes_read;
+}
+
+/*
+ * Signals whether the session has messages to read, following its file pointer.
+ * */
+static __poll_t aos_poll(struct file *filp, poll_table *wait){
+    struct aos_file *af = filp->private_data;
+
+    if (!is_mounted) return EPOLLERR;
+
+    poll_wait(filp, &info->chain_wq, wait);
+
+    return (first_to_read(af, filp->f_pos) != 0) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+/*
+ * Handles the commands on the device file:
+ *  - AOS_IOC_FOLLOW enables (arg 1) or disables (arg 0) the follow mode of the session;
+ *  - AOS_IOC_COMPACT relocates the messages so that the chain is laid out on consecutive blocks, storing the outcome
+ *    in the 'struct aos_compact_stats' pointed by arg. Since relocated messages change their offset, it requires
+ *    CAP_SYS_ADMIN, and the old and new offset of each relocated message are stored in the map given by the caller,
+ *    which bounds the number of relocations. The old offsets are only given back to the PUTs once the map has been
+ *    copied: until then a GET or an INV of an old offset fails as for an invalidated message. An offset where a
+ *    message has been moved in, after moving its own message away, is reported by the map as both an old and a new
+ *    offset: it keeps a different message right away.
+ * */
+static long aos_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+    struct aos_file *af = filp->private_data;
+    struct aos_compact_stats stats;
+    struct aos_compact_move *moves;
+    uint64_t max;
+    int ret;
+
+    check_mount;
+
+    switch (cmd) {
+        case AOS_IOC_FOLLOW:
+            af->follow = (arg != 0);
+            return 0;
+        case AOS_IOC_COMPACT:
+            if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+
+            if (copy_from_user(&stats, (void __user *)arg, sizeof(stats))) return -EFAULT;
+            if (!stats.map || !stats.map_len) return -EINVAL;
+
+            /* A message is moved twice at most */
+            max = min_t(uint64_t, stats.map_len, 2 * info->sb.partition_size);
+            moves = kvmalloc_array(max, sizeof(struct aos_compact_move), GFP_KERNEL);
+            if (!moves) return -ENOMEM;
+
+            ret = compact_chain(&stats, moves, max);
+
+            /* The map is handed over even if the compaction stopped early, then the old offsets can be reused */
+            if (copy_to_user((void __user *)(uintptr_t)stats.map, moves, stats.moved * sizeof(struct aos_compact_move))
+                || copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+                if (ret == 0) ret = -EFAULT;
+            }
+            release_moved(moves, stats.moved);
+            kvfree(moves);
+
+            return ret;
+        default:
+            return -ENOTTY;
+    }
 }
 
 /*
@@ -213,6 +336,13 @@ const struct file_operations aos_file_ops = {
     .owner = THIS_MODULE,
     .open = aos_open,
     .release = aos_release,
-    .read = aos_read
+    .read_iter = aos_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .poll = aos_poll,
+    .unlocked_ioctl = aos_ioctl
 };
 
@@ -7,20 +7,26 @@
 
 #include "../include/aos_fs.h"
 
+#define BITMAP_BLOCKS(n) (((n) + BITMAP_BLOCK_BITS - 1) / BITMAP_BLOCK_BITS)
+
 static int build_superblock(int fd, int nblocks){
     ssize_t ret;
 
     struct aos_super_block aos_sb = {
             .magic = MAGIC,
+            .version = AOS_VERSION,
             .block_size = AOS_BLOCK_SIZE,
             .data_block_size = sizeof(struct aos_db_userdata),
             .partition_size = nblocks+2,
             .last = 1,
+            .bitmap_start = nblocks+2,
+            .bitmap_blocks = BITMAP_BLOCKS(nblocks+2),
+            .journal_start = nblocks+2 + BITMAP_BLOCKS(nblocks+2),
+            .journal_blocks = JOURNAL_BLOCKS,
+            .journal_seq = 1,
             .padding = 0
     };
 
-    *aos_sb.padding |= 3UL; /* Sets the first and second bits of the bitmap to lock superblock and inode */
-
     ret = write(fd, (char *)&aos_sb, sizeof(aos_sb));
     if (ret != AOS_BLOCK_SIZE) {
         printf("SB: Bytes written [%d] are not equal to the default block size.\n", (int)ret);
@@ -87,6 +93,43 @@ int build_data_blocks(int fd, int nblocks){
     return 0;
 }
 
+int build_bitmap(int fd, int nblocks){
+    ssize_t ret;
+    int i;
+    char block[AOS_BLOCK_SIZE] = { 0 };
+
+    block[0] = 3; /* Sets the first and second bits of the bitmap to lock superblock and inode */
+
+    for (i = 0; i < BITMAP_BLOCKS(nblocks+2); ++i) {
+        ret = write(fd, block, AOS_BLOCK_SIZE);
+        if (ret != AOS_BLOCK_SIZE){
+            printf("Bitmap: Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+            return -1;
+        }
+        block[0] = 0;
+    }
+
+    printf("Free blocks bitmap written successfully\n");
+    return 0;
+}
+
+int build_journal(int fd){
+    ssize_t ret;
+    int i;
+    char block[AOS_BLOCK_SIZE] = { 0 }; /* Records with sequence number 0, never written */
+
+    for (i = 0; i < JOURNAL_BLOCKS; ++i) {
+        ret = write(fd, block, AOS_BLOCK_SIZE);
+        if (ret != AOS_BLOCK_SIZE){
+            printf("Journal: Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+            return -1;
+        }
+    }
+
+    printf("Metadata journal written successfully\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int fd, nblocks;
@@ -108,8 +151,8 @@ int main(int argc, char *argv[])
     if (nblocks < 1){
         printf("NBLOCKS must be at least 1 to have at least 1 data block\n");
         goto failure_2;
-    } else if (nblocks > NBLOCKS) {
-        printf("NBLOCKS exceeds the maximum number of manageable blocks (%d)\n", NBLOCKS);
+    } else if (nblocks > NBLOCKS - 2) {
+        printf("NBLOCKS exceeds the maximum number of manageable blocks (%d)\n", NBLOCKS - 2);
         goto failure_2;
     }
 
@@ -122,6 +165,12 @@ int main(int argc, char *argv[])
     /* Configure Data blocks */
     if(build_data_blocks(fd, nblocks)) goto failure_3;
 
+    /* Configure the free blocks bitmap region */
+    if(build_bitmap(fd, nblocks)) goto failure_3;
+
+    /* Configure the metadata journal region */
+    if(build_journal(fd)) goto failure_3;
+
     close(fd);
     return 0;
 
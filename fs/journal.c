@@ -0,0 +1,383 @@
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+
+#include "../include/aos_fs.h"
+#include "../include/config.h"
+#include "../include/utils.h"
+#include "../include/journal.h"
+#include "../include/aos_trace.h"
+
+/**
+ * This module implements the metadata journal. Every update of the chain (a block appended, detached, invalidated or
+ * moved) is logged as a small record in a ring kept in its own region of the device, together with the update of
+ * 'first' and 'last' it implies. A checkpoint periodically saves 'first', 'last' and the free blocks bitmap in the
+ * superblock and in the bitmap region: after a crash, the mount replays the few records logged since then instead of
+ * trusting the state saved at the last unmount.
+ * */
+
+/* Fields of a block restored by the replay */
+#define FIX_PREV 0x1
+#define FIX_NEXT 0x2
+#define FIX_INVALID 0x4
+
+extern aos_fs_info_t *info;
+
+static void checkpoint_work(struct work_struct *work);
+
+/*
+ * Returns the slot of the record with sequence number 'seq', leaving in 'bh' the journal block keeping it.
+ * */
+static inline struct aos_journal_record* journal_slot(uint64_t seq, struct buffer_head **bh){
+    uint64_t slot = seq % info->journal.capacity;
+
+    *bh = info->journal.bhs[slot / JOURNAL_RECORDS];
+    return (struct aos_journal_record*)(*bh)->b_data + slot % JOURNAL_RECORDS;
+}
+
+/*
+ * Checks whether the journal has room for 'n' more records. Called with the journal lock held.
+ * */
+static inline bool journal_room(uint64_t n){
+    struct aos_journal *j = &info->journal;
+
+    return j->seq - j->tail + j->reserved + n <= j->capacity;
+}
+
+/**
+ * Reads the journal region, whose blocks are kept in memory until the unmount, and initializes the journal state.
+ * The next records follow every record left in the region, so that none of the stale ones can be taken for a new one:
+ * the state has to be checkpointed before logging new records.
+ * */
+int journal_load(void){
+    struct aos_journal *j = &info->journal;
+    struct aos_journal_record *r;
+    struct buffer_head *bh;
+    uint64_t i, max_seq = 0, start = info->sb.journal_start, nblocks = info->sb.journal_blocks;
+
+    /* A batch of MAX_VEC PUTs must always fit in the journal */
+    if (nblocks * JOURNAL_RECORDS < 4 * MAX_VEC) return -EINVAL;
+
+    j->bhs = kcalloc(nblocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!j->bhs) return -ENOMEM;
+
+    for (i = 0; i < nblocks; ++i) sb_breadahead(info->vfs_sb, start + i);
+
+    for (i = 0; i < nblocks; ++i) {
+        j->bhs[i] = sb_bread(info->vfs_sb, start + i);
+        if (!j->bhs[i]) {
+            journal_free();
+            return -EIO;
+        }
+    }
+
+    j->capacity = nblocks * JOURNAL_RECORDS;
+    for (i = 0; i < j->capacity; ++i) {
+        r = journal_slot(i, &bh);
+        if (r->seq > max_seq) max_seq = r->seq;
+    }
+    j->tail = info->sb.journal_seq;
+    j->seq = max_t(uint64_t, j->tail, max_seq + 1);
+    j->reserved = 0;
+    spin_lock_init(&j->lock);
+    init_waitqueue_head(&j->wait);
+    mutex_init(&j->ckpt_mutex);
+    INIT_DELAYED_WORK(&j->ckpt_work, checkpoint_work);
+
+    return 0;
+}
+
+/**
+ * Releases the journal blocks loaded by 'journal_load'
+ * */
+void journal_free(void){
+    uint64_t i;
+
+    if (!info->journal.bhs) return;
+
+    for (i = 0; i < info->sb.journal_blocks; ++i) {
+        if (info->journal.bhs[i]) brelse(info->journal.bhs[i]);
+    }
+    kfree(info->journal.bhs);
+    info->journal.bhs = NULL;
+}
+
+/*
+ * Brings the metadata of the block 'blk' in line with a replayed record, in case the write of the block did not reach
+ * the device before the crash.
+ * */
+static int fix_block(uint64_t blk, int fields, uint64_t prev, uint64_t next){
+    struct buffer_head *bh;
+    struct aos_data_block *data_block;
+    struct aos_db_metadata old;
+    int res;
+
+    if (blk < 2 || blk >= info->sb.partition_size) return -EINVAL;
+
+    res = get_blk(&bh, info->vfs_sb, blk, &data_block);
+    if (res < 0) return res;
+
+    old = data_block->metadata;
+    if (fields & FIX_PREV) data_block->metadata.prev = prev;
+    if (fields & FIX_NEXT) data_block->metadata.next = next;
+    if (fields & FIX_INVALID) data_block->metadata.is_valid = 0;
+
+    if (memcmp(&old, &data_block->metadata, sizeof(old))) mark_buffer_dirty(bh);
+    brelse(bh);
+
+    return 0;
+}
+
+/*
+ * Applies the record 'r' to 'first', 'last', the free blocks bitmap and the links of the blocks involved, following
+ * the same rules of the update that logged it.
+ * */
+static int replay_record(struct aos_journal_record *r){
+    uint64_t nblocks = info->sb.partition_size;
+    int res = 0;
+
+    if (r->blk < 2 || r->blk >= nblocks || (r->type == JR_MOVE && (r->src < 2 || r->src >= nblocks))) return -EINVAL;
+
+    switch (r->type) {
+        case JR_UNLINK:
+            if (info->first == r->blk) {
+                info->first = r->next;
+                if (info->last == r->blk) info->last = 1;
+            } else if (info->last == r->blk) {
+                info->last = r->prev;
+            }
+            if (r->next != 0) {
+                if (r->prev != 1) res = fix_block(r->prev, FIX_NEXT, 0, r->next);
+                if (res == 0) res = fix_block(r->next, FIX_PREV, r->prev, 0);
+            }
+            break;
+        case JR_PUT:
+            set_bit(r->blk, info->free_blocks);
+            if (r->prev == 1) {
+                info->first = r->blk;
+            } else {
+                res = fix_block(r->prev, FIX_NEXT, 0, r->blk);
+            }
+            info->last = r->blk;
+            if (res == 0) res = fix_block(r->blk, FIX_PREV | FIX_NEXT, r->prev, 0);
+            break;
+        case JR_INV:
+            clear_bit(r->blk, info->free_blocks);
+            if (info->first == r->blk) {
+                info->first = r->next;
+                if (info->last == r->blk) info->last = 1;
+                res = fix_block(r->blk, FIX_INVALID, 0, 0);
+            } else if (info->last == r->blk) {
+                info->last = r->prev;
+                res = fix_block(r->blk, FIX_INVALID | FIX_NEXT, 0, 0);
+            } else {
+                res = fix_block(r->blk, FIX_INVALID, 0, 0);
+            }
+            break;
+        case JR_FREE:
+            clear_bit(r->blk, info->free_blocks);
+            if (info->last == r->blk) {
+                info->last = r->prev;
+                if (r->prev == 1) info->first = 0;
+            }
+            res = fix_block(r->blk, FIX_INVALID, 0, 0);
+            break;
+        case JR_MOVE:
+            set_bit(r->blk, info->free_blocks);
+            clear_bit(r->src, info->free_blocks);
+            if (info->first == r->src) info->first = r->blk;
+            if (info->last == r->src) info->last = r->blk;
+            if (r->prev != 1) res = fix_block(r->prev, FIX_NEXT, 0, r->blk);
+            if (res == 0 && r->next != 0) res = fix_block(r->next, FIX_PREV, r->blk, 0);
+            if (res == 0) res = fix_block(r->src, FIX_INVALID | FIX_NEXT, 0, 0);
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    return res;
+}
+
+/**
+ * Replays the records logged after the last checkpoint on the state loaded from the superblock and the bitmap region.
+ * The replay stops at the first slot that does not keep the expected record: the records logged afterwards never
+ * reached the device as a whole.
+ * @return the number of replayed records; EINVAL if a record is inconsistent with the device
+ * */
+int journal_replay(void){
+    struct aos_journal *j = &info->journal;
+    struct aos_journal_record *r;
+    struct buffer_head *bh;
+    uint64_t seq;
+    int res, count = 0;
+
+    for (seq = j->tail; seq - j->tail < j->capacity; ++seq) {
+        r = journal_slot(seq, &bh);
+        if (r->seq != seq) break;
+
+        res = replay_record(r);
+        if (res < 0) {
+            printk(KERN_ALERT "%s: [journal_replay()] couldn't replay record %llu of type %u\n", MODNAME, seq, r->type);
+            return res;
+        }
+        count++;
+    }
+
+    AUDIT { printk(KERN_INFO "%s: [journal_replay()] Replayed %d journal records\n", MODNAME, count); }
+
+    return count;
+}
+
+/**
+ * Reserves room in the journal for 'n' records, to be logged by an update that cannot wait once it holds its locks.
+ * When the journal is full the caller waits for a checkpoint to make room; once half of it is in use, a checkpoint
+ * is started in advance. The reservation has to be made before taking 'relink_sem', which the checkpoint needs.
+ * */
+void journal_reserve(int n){
+    struct aos_journal *j = &info->journal;
+    bool half;
+
+    spin_lock(&j->lock);
+    while (!journal_room(n)) {
+        spin_unlock(&j->lock);
+        mod_delayed_work(system_wq, &j->ckpt_work, 0);
+        wait_event(j->wait, journal_room(n));
+        spin_lock(&j->lock);
+    }
+    j->reserved += n;
+    half = !journal_room(j->capacity / 2);
+    spin_unlock(&j->lock);
+
+    if (half) mod_delayed_work(system_wq, &j->ckpt_work, 0);
+}
+
+/**
+ * Gives back 'n' reserved records that were not logged
+ * */
+void journal_release(int n){
+    if (n == 0) return;
+
+    spin_lock(&info->journal.lock);
+    info->journal.reserved -= n;
+    spin_unlock(&info->journal.lock);
+
+    if (wq_has_sleeper(&info->journal.wait)) wake_up_all(&info->journal.wait);
+}
+
+/**
+ * Logs a record of type 'type' in the journal, consuming one of the records reserved by the caller.
+ * Called with the journal lock held, right after the update of 'first' and 'last' the record describes, so that the
+ * records follow the order of those updates. The journal block is only marked dirty: for a synchronous PUT 'c', it is
+ * written on the device together with the rest of the PUT.
+ * */
+void journal_log(uint32_t type, uint64_t blk, uint64_t prev, uint64_t next, uint64_t src, struct aos_commit *c){
+    struct aos_journal *j = &info->journal;
+    struct aos_journal_record *r;
+    struct buffer_head *bh;
+
+    r = journal_slot(j->seq, &bh);
+    r->type = type;
+    r->blk = blk;
+    r->prev = prev;
+    r->next = next;
+    r->src = src;
+    r->padding = 0;
+    r->seq = j->seq++;
+    j->reserved--;
+
+    mark_buffer_dirty(bh);
+    if (c && (c->n == 0 || c->bhs[c->n - 1] != bh)) c->bhs[c->n++] = get_bh(bh);
+}
+
+/*
+ * Saves the free blocks bitmap in its on-disk region. The blocks are only marked dirty: the caller is in charge
+ * of flushing them.
+ * */
+static int save_bitmap(void) {
+    struct buffer_head *bh;
+    uint64_t i, len, bytes = BITS_TO_LONGS(info->sb.partition_size) * sizeof(long);
+
+    for (i = 0; i < info->sb.bitmap_blocks; ++i) {
+        bh = sb_bread(info->vfs_sb, info->sb.bitmap_start + i);
+        if (!bh) return -EIO;
+
+        len = min_t(uint64_t, AOS_BLOCK_SIZE, bytes - i * AOS_BLOCK_SIZE);
+        memcpy(bh->b_data, (char *)info->free_blocks + i * AOS_BLOCK_SIZE, len);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a checkpoint: 'first', 'last' and the free blocks bitmap are saved as of the next record of the journal, once
+ * every dirty block of the device has been written, so that the older records are no longer needed and their room can
+ * be reused.
+ * The state is taken with 'relink_sem' held for writing, so that every logged update is complete in memory when the
+ * blocks are written. Blocks freed after their invalidation was logged may be saved as taken: the mount gives them
+ * back while building the chain.
+ * */
+int journal_checkpoint(void){
+    struct aos_journal *j = &info->journal;
+    struct super_block *sb = info->vfs_sb;
+    struct aos_super_block *aos_sb;
+    struct buffer_head *bh;
+    uint64_t seq, first, last;
+    int res;
+
+    mutex_lock(&j->ckpt_mutex);
+
+    percpu_down_write(&info->relink_sem);
+    spin_lock(&j->lock);
+    seq = j->seq;
+    first = info->first;
+    last = info->last;
+    spin_unlock(&j->lock);
+    percpu_up_write(&info->relink_sem);
+
+    res = save_bitmap();
+    if (res < 0) goto failure;
+
+    /* The blocks updated by the records before 'seq' must be on the device before the superblock moves past them */
+    res = sync_blockdev(sb->s_bdev);
+    if (res < 0) goto failure;
+
+    bh = sb_bread(sb, SUPER_BLOCK_IDX);
+    if (!bh) {
+        res = -EIO;
+        goto failure;
+    }
+    aos_sb = (struct aos_super_block*)bh->b_data;
+    aos_sb->first = first;
+    aos_sb->last = last;
+    aos_sb->journal_seq = seq;
+    mark_buffer_dirty(bh);
+    res = sync_dirty_buffer(bh);
+    brelse(bh);
+    if (res < 0) goto failure;
+
+    spin_lock(&j->lock);
+    j->tail = seq;
+    spin_unlock(&j->lock);
+    wake_up_all(&j->wait);
+
+    trace_checkpoint(seq);
+
+failure:
+    mutex_unlock(&j->ckpt_mutex);
+
+    if (res < 0) printk(KERN_ALERT "%s: [journal_checkpoint()] checkpoint failed with error %d\n", MODNAME, res);
+    return res;
+}
+
+/*
+ * Periodic checkpoint, also started in advance when the journal is half full
+ * */
+static void checkpoint_work(struct work_struct *work){
+    journal_checkpoint();
+
+    if (READ_ONCE(is_mounted)) {
+        mod_delayed_work(system_wq, &info->journal.ckpt_work, msecs_to_jiffies(CHECKPOINT_INTERVAL));
+    }
+}
@@ -0,0 +1,268 @@
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+
+#include "../include/aos_fs.h"
+#include "../include/config.h"
+#include "../include/utils.h"
+#include "../include/journal.h"
+
+/**
+ * This module implements the recovery of the allocation state from the metadata of the blocks, for when neither the
+ * superblock nor the journal can be trusted. The data area is read with large bios by several workers, each one on
+ * its own share of the device, so that the scan runs at the sequential bandwidth of the device; the free blocks bitmap,
+ * 'first' and 'last' are then rebuilt from the 'is_valid', 'prev' and 'next' fields of the blocks.
+ * */
+
+extern aos_fs_info_t *info;
+
+/* Links of a block as found on the device */
+struct aos_link {
+    uint32_t prev;
+    uint32_t next;
+};
+
+/* Share of the data area scanned by a recovery worker */
+struct aos_scan {
+    struct work_struct work;
+    struct aos_link *links;     /* Links of every block, filled in by the workers on their own shares */
+    uint64_t start;             /* First block of the share */
+    uint64_t end;               /* End of the share */
+    uint64_t valid;             /* Number of valid blocks found in the share */
+    int err;                    /* Outcome of the scan of the share */
+};
+
+/*
+ * Reads the 'n' blocks starting from 'blk' into 'pages', one block per page, with a single bio
+ * */
+static int read_blocks(struct page **pages, uint64_t blk, int n){
+    struct block_device *bdev = info->vfs_sb->s_bdev;
+    struct bio *bio;
+    int i, res;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+    bio = bio_alloc(bdev, n, REQ_OP_READ, GFP_KERNEL);
+#else
+    bio = bio_alloc(GFP_KERNEL, n);
+    bio_set_dev(bio, bdev);
+    bio->bi_opf = REQ_OP_READ;
+#endif
+    bio->bi_iter.bi_sector = blk * (AOS_BLOCK_SIZE >> SECTOR_SHIFT);
+
+    for (i = 0; i < n; ++i) {
+        if (bio_add_page(bio, pages[i], AOS_BLOCK_SIZE, 0) != AOS_BLOCK_SIZE) {
+            bio_put(bio);
+            return -EIO;
+        }
+    }
+
+    res = submit_bio_wait(bio);
+    bio_put(bio);
+
+    return res;
+}
+
+/*
+ * Scans a share of the data area, RECOVERY_BATCH blocks per bio, recording the links of each block and marking the
+ * valid ones in the free blocks bitmap
+ * */
+static void scan_work(struct work_struct *work){
+    struct aos_scan *s = container_of(work, struct aos_scan, work);
+    struct aos_db_metadata *metadata;
+    struct page **pages;
+    uint64_t blk, nblocks = info->sb.partition_size;
+    int i, n;
+
+    pages = kcalloc(RECOVERY_BATCH, sizeof(struct page *), GFP_KERNEL);
+    if (!pages) {
+        s->err = -ENOMEM;
+        return;
+    }
+
+    for (i = 0; i < RECOVERY_BATCH; ++i) {
+        pages[i] = alloc_page(GFP_KERNEL);
+        if (!pages[i]) {
+            s->err = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (blk = s->start; blk < s->end; blk += n) {
+        n = min_t(uint64_t, RECOVERY_BATCH, s->end - blk);
+
+        s->err = read_blocks(pages, blk, n);
+        if (s->err < 0) goto out;
+
+        for (i = 0; i < n; ++i) {
+            metadata = &((struct aos_data_block*)page_address(pages[i]))->metadata;
+
+            /* Out of range links are dropped */
+            s->links[blk + i].prev = (metadata->prev < nblocks) ? metadata->prev : 0;
+            s->links[blk + i].next = (metadata->next < nblocks) ? metadata->next : 0;
+            if (metadata->is_valid) {
+                set_bit(blk + i, info->free_blocks);
+                s->valid++;
+            }
+        }
+
+        cond_resched();
+    }
+
+out:
+    for (i = 0; i < RECOVERY_BATCH; ++i) {
+        if (pages[i]) __free_page(pages[i]);
+    }
+    kfree(pages);
+}
+
+/*
+ * Updates the links of the block 'blk', on the device and in 'links'
+ * */
+static int set_links(struct aos_link *links, uint64_t blk, uint64_t prev, uint64_t next){
+    struct buffer_head *bh;
+    struct aos_data_block *data_block;
+    int res;
+
+    res = get_blk(&bh, info->vfs_sb, blk, &data_block);
+    if (res < 0) return res;
+
+    data_block->metadata.prev = prev;
+    data_block->metadata.next = next;
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    links[blk].prev = prev;
+    links[blk].next = next;
+
+    return 0;
+}
+
+/*
+ * Checks whether 'next' is the successor of 'blk' on both sides of the links
+ * */
+static inline bool linked(struct aos_link *links, uint64_t blk, uint64_t next){
+    uint64_t nblocks = info->sb.partition_size;
+
+    return blk >= 2 && blk < nblocks && next >= 2 && next < nblocks && links[blk].next == next && links[next].prev == blk;
+}
+
+/*
+ * Detaches the invalid blocks that follow 'blk', the last valid block of a run, so that a later reuse of any of them
+ * cannot relink something behind the end of the chain
+ * */
+static int detach_tail(struct aos_link *links, uint64_t blk){
+    uint64_t cur, next, steps, nblocks = info->sb.partition_size;
+    int res;
+
+    for (cur = blk, next = links[blk].next, steps = 0; steps < nblocks; ++steps) {
+        if (next < 2 || next >= nblocks || links[next].prev != cur || test_bit(next, info->free_blocks)) break;
+
+        cur = next;
+        next = links[cur].next;
+        res = set_links(links, cur, links[cur].prev, 0);
+        if (res < 0) return res;
+    }
+
+    return (links[blk].next == 0) ? 0 : set_links(links, blk, links[blk].prev, 0);
+}
+
+/**
+ * Rebuilds the free blocks bitmap, 'first' and 'last' from the metadata of the data blocks, for a device whose
+ * superblock and journal cannot be trusted.
+ * The links of the blocks are collected by a parallel scan of the data area. The run of linked blocks holding the
+ * first valid block becomes the chain; the valid blocks found out of it, whose links were lost, are appended run by
+ * run in block order, so that no valid message is dropped. 'last' is the last valid block, and the invalid blocks
+ * following it are detached.
+ * @return the number of valid blocks found
+ * */
+int recover_state(void){
+    struct aos_scan *scans;
+    struct aos_link *links;
+    ulong *seen;
+    uint64_t nblocks = info->sb.partition_size;
+    uint64_t blk, cur, prev, run_last, steps, share, valid = 0;
+    int i, nworkers, runs = 0, res = 0;
+    ktime_t start = ktime_get();
+
+    /* The scan reads the device directly: the buffers dirtied so far must reach it first */
+    res = sync_blockdev(info->vfs_sb->s_bdev);
+    if (res < 0) return res;
+
+    links = kvzalloc(nblocks * sizeof(struct aos_link), GFP_KERNEL);
+    seen = kvzalloc(BITS_TO_LONGS(nblocks) * sizeof(long), GFP_KERNEL);
+    nworkers = min_t(int, num_online_cpus(), RECOVERY_WORKERS);
+    scans = kcalloc(nworkers, sizeof(struct aos_scan), GFP_KERNEL);
+    if (!links || !seen || !scans) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    /* Scan the data area in parallel, on shares of whole bios */
+    bitmap_zero(info->free_blocks, nblocks);
+    share = roundup(DIV_ROUND_UP(nblocks - 2, nworkers), RECOVERY_BATCH);
+    for (i = 0; i < nworkers; ++i) {
+        scans[i].links = links;
+        scans[i].start = min_t(uint64_t, 2 + i * share, nblocks);
+        scans[i].end = min_t(uint64_t, scans[i].start + share, nblocks);
+        INIT_WORK(&scans[i].work, scan_work);
+        queue_work(system_unbound_wq, &scans[i].work);
+    }
+    for (i = 0; i < nworkers; ++i) {
+        flush_work(&scans[i].work);
+        if (scans[i].err < 0 && res == 0) res = scans[i].err;
+        valid += scans[i].valid;
+    }
+    if (res < 0) goto out;
+
+    set_bit(SUPER_BLOCK_IDX, info->free_blocks);
+    set_bit(INODE_BLOCK_IDX, info->free_blocks);
+
+    /* Follow every run of linked blocks from its head, starting from the runs of the valid blocks with lower index */
+    info->first = 0;
+    info->last = 1;
+    for (blk = find_next_bit(info->free_blocks, nblocks, 2); blk < nblocks;
+         blk = find_next_bit(info->free_blocks, nblocks, blk + 1)) {
+        if (test_bit(blk, seen)) continue;
+
+        /* Go back to the head of the run */
+        for (cur = blk, steps = 0; steps < nblocks; ++steps) {
+            prev = links[cur].prev;
+            if (!linked(links, prev, cur) || test_bit(prev, seen)) break;
+            cur = prev;
+        }
+
+        /* Append the run to the chain */
+        if (info->last == 1) {
+            info->first = cur;
+        } else {
+            res = detach_tail(links, info->last);
+            if (res == 0) res = set_links(links, info->last, links[info->last].prev, cur);
+            if (res == 0) res = set_links(links, cur, info->last, links[cur].next);
+            if (res < 0) goto out;
+        }
+        runs++;
+
+        /* Go forward to its last valid block */
+        for (run_last = blk, steps = 0; steps < nblocks; ++steps) {
+            set_bit(cur, seen);
+            if (test_bit(cur, info->free_blocks)) run_last = cur;
+            if (!linked(links, cur, links[cur].next) || test_bit(links[cur].next, seen)) break;
+            cur = links[cur].next;
+        }
+        info->last = run_last;
+    }
+    if (info->last != 1) res = detach_tail(links, info->last);
+    if (res < 0) goto out;
+
+    AUDIT { printk(KERN_INFO "%s: [recover_state()] Scanned %llu blocks with %d workers in %lld ms: %llu valid blocks "
+                   "in %d runs, first %llu, last %llu\n", MODNAME, nblocks - 2, nworkers,
+                   ktime_ms_delta(ktime_get(), start), valid, runs, info->first, info->last); }
+
+out:
+    kfree(scans);
+    kvfree(seen);
+    kvfree(links);
+    return (res < 0) ? res : valid;
+}
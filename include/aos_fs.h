@@ -8,7 +8,17 @@
 #include <linux/seqlock.h>
 #include <linux/slab.h>
 #include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/eventfd.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/mutex.h>
+#include <linux/percpu-refcount.h>
+#include <linux/completion.h>
+#include <linux/rcupdate.h>
+#include <linux/kobject.h>
 #endif
+#include <linux/ioctl.h>
 
 #define MAGIC 0x42424242
 #define AOS_BLOCK_SIZE 4096
@@ -17,25 +27,80 @@
 #define FILENAME_MAXLEN 255
 #define ROOT_INODE_NUMBER 10
 #define FILE_INODE_NUMBER 1
-#define NBLOCKS 32384           /* Maximum number of manageable blocks as limited by the use of 'padding' */
+#define NBLOCKS 0x7fffffff      /* Maximum number of manageable blocks as limited by the 32 bits block indexes */
+#define AOS_VERSION 3           /* Version of the on-disk layout */
+#define BITMAP_BLOCK_BITS (AOS_BLOCK_SIZE * 8)  /* Number of blocks tracked by each block of the bitmap region */
+#define JOURNAL_BLOCKS 32       /* Number of blocks in the metadata journal region */
+#define JOURNAL_RECORDS (AOS_BLOCK_SIZE / sizeof(struct aos_journal_record))   /* Records in a journal block */
 #define DEVICE_NAME "the-device"
 #define MODNAME "AOS"
 #define AUDIT if(1)
 
 #define check_mount if (!is_mounted) return -ENODEV
 #define EXTRA_BITS(dim) (AOS_BLOCK_SIZE/sizeof(ulong) - ((dim) * (sizeof(uint64_t)/sizeof(ulong))))
-#define MAX_READ (64 * 1024)
+#define MAX_VEC 1024            /* Maximum number of messages handled by a single vectored system call */
 
-/* Superblock definition */
+/* Flags of the vectored PUT */
+#define PUT_VEC_ATOMIC 0x1      /* The whole batch is put all or nothing, instead of each message on its own */
+
+/* Commands on the device file */
+#define AOS_IOC_FOLLOW _IO('A', 1)   /* Enable (arg 1) or disable (arg 0) the follow mode of the reads */
+#define AOS_IOC_COMPACT _IOWR('A', 2, struct aos_compact_stats)     /* Lay out the chain on consecutive blocks */
+
+/* Relocation of a message by a compaction */
+struct aos_compact_move {
+    uint64_t from;              /* Offset of the message before the compaction */
+    uint64_t to;                /* Offset of the message after the compaction */
+};
+
+/* Arguments and outcome of a compaction of the chain */
+struct aos_compact_stats {
+    uint64_t map;               /* User-space array of 'map_len' struct aos_compact_move, filled with the relocations */
+    uint64_t map_len;           /* Maximum number of relocations of the compaction */
+    uint64_t moved;             /* Number of messages relocated, i.e. of entries written in 'map' */
+    uint64_t breaks_before;     /* Hops of the chain between non-consecutive blocks, before the compaction */
+    uint64_t breaks_after;      /* Hops of the chain between non-consecutive blocks, after the compaction */
+};
+
+/* Superblock definition.
+ * The free blocks bitmap is kept in a dedicated region of 'bitmap_blocks' blocks, following the data blocks, and the
+ * metadata journal in a region of 'journal_blocks' blocks, following the bitmap. 'first', 'last' and the bitmap
+ * describe the device as of the record 'journal_seq' of the journal, the first one still to be replayed. */
 struct aos_super_block {
     uint64_t magic;             /* Magic number to identify the file system */
+    uint64_t version;           /* Version of the on-disk layout */
     uint64_t block_size;        /* Block size in bytes */
     uint64_t data_block_size;   /* Block size in bytes */
-    uint64_t partition_size;    /* Number of blocks in the file system */
+    uint64_t partition_size;    /* Number of blocks in the file system, excluding the bitmap region */
     uint64_t first;             /* First valid block to be restored when mounting */
     uint64_t last;              /* Last valid block to be restored when mounting */
+    uint64_t bitmap_start;      /* First block of the free blocks bitmap region */
+    uint64_t bitmap_blocks;     /* Number of blocks in the free blocks bitmap region */
+    uint64_t journal_start;     /* First block of the metadata journal region */
+    uint64_t journal_blocks;    /* Number of blocks in the metadata journal region */
+    uint64_t journal_seq;       /* Sequence number of the first journal record not covered by the last checkpoint */
+
+    ulong padding[EXTRA_BITS(12)]; /* Padding to fit into a single block */
+};
 
-    ulong padding[EXTRA_BITS(6)]; /* Padding to fit into a single block: used to save the free blocks bitmap */
+/* Types of the records of the metadata journal */
+#define JR_UNLINK 1             /* A reused block was detached from its old position: 'prev' and 'next' linked */
+#define JR_PUT 2                /* A block was taken and appended to the chain after 'prev' */
+#define JR_INV 3                /* A block was invalidated and freed, 'prev' and 'next' being its surviving neighbours */
+#define JR_FREE 4               /* A block appended by a failed PUT was left invalid in the chain and freed, 'prev'
+                                   being its predecessor */
+#define JR_MOVE 5               /* The message of the block 'src' was moved to the block 'blk', between 'prev' and 'next' */
+
+/* Record of the metadata journal. The records are stored in a ring over the journal region, at the position given by
+ * their sequence number: a slot whose sequence number does not match its position ends the journal. */
+struct aos_journal_record {
+    uint64_t seq;               /* Sequence number of the record (0: never written) */
+    uint32_t type;              /* Type of the record */
+    uint32_t blk;               /* Block the record refers to */
+    uint32_t prev;              /* Predecessor of the block in the chain (1 if none) */
+    uint32_t next;              /* Successor of the block in the chain (0 if none) */
+    uint32_t src;               /* Old position of a moved message */
+    uint32_t padding;
 };
 
 /* inode definition */
@@ -59,6 +124,7 @@ struct aos_db_metadata{
     uint64_t is_valid;
     uint64_t prev;
     uint64_t next;
+    uint64_t length;            /* Length in bytes of the message kept by the block */
 };
 
 struct aos_db_userdata{
@@ -72,27 +138,137 @@ struct aos_data_block {
 
 /* file system info */
 #ifdef __KERNEL__
+/* Entry of the in-memory mirror of the chronological chain, which links valid blocks only */
+struct aos_chain_entry {
+    uint32_t prev;              /* Previous valid block (0 if none) */
+    uint32_t next;              /* Next valid block (0 if none) */
+    uint32_t pub_next;          /* Next block to be published after this one, while its PUT is pending */
+    uint32_t seq;               /* Publication order of the block */
+};
+
+/* State of an open session on the device file */
+struct aos_file {
+    uint32_t seq;               /* Publication order of the last block read, once the end of the chain is reached */
+    bool follow;                /* Reads at the end of the chain wait for new messages instead of returning 0 */
+};
+
+/* States of a slot of the asynchronous PUT ring */
+#define ASYNC_FREE 0            /* No PUT, or its result has been reaped */
+#define ASYNC_PENDING 1         /* The PUT has been submitted and not completed yet */
+#define ASYNC_DONE 2            /* The PUT has completed and its result can be reaped */
+#define ASYNC_CLAIMED 3         /* The slot has been taken by a PUT still being submitted */
+
+/* Asynchronous PUT, from its submission until its result is reaped */
+struct aos_async_put {
+    struct work_struct work;    /* Deferred execution of the PUT, initialized once with the ring */
+    uint64_t ticket;            /* Ticket returned at submission */
+    uint64_t blk;               /* Block the message has been written in */
+    struct buffer_head *bh;     /* Buffer of the block, released once it is linked */
+    struct eventfd_ctx *efd;    /* Eventfd signalled on completion (NULL if none) */
+    struct pid *owner;          /* Process that submitted the PUT, the only one that can reap it */
+    int64_t res;                /* Block index where the message was put, or error */
+    int state;                  /* State of the slot */
+};
+
+/* Synchronous PUT waiting for the blocks it dirtied to be written on the device */
+struct aos_commit {
+    struct list_head list;      /* Entry in the group commit queue */
+    struct buffer_head **bhs;   /* Dirty buffers of the PUT: payloads and link updates */
+    int n;                      /* Number of dirty buffers */
+    int err;                    /* Outcome of the write */
+    bool done;                  /* The buffers are stable on the device */
+};
+
+/* In-memory state of the metadata journal */
+struct aos_journal {
+    struct buffer_head **bhs;   /* Blocks of the journal region, kept in memory while mounted */
+    uint64_t capacity;          /* Number of records in the journal region */
+    spinlock_t lock;            /* Orders the records with the updates of 'first' and 'last' they describe */
+    uint64_t seq;               /* Sequence number of the next record */
+    uint64_t tail;              /* Sequence number of the first record not covered by the last checkpoint */
+    uint64_t reserved;          /* Records reserved by the updates in progress and not logged yet */
+    wait_queue_head_t wait;     /* Updates waiting for a checkpoint to make room in the journal */
+    struct mutex ckpt_mutex;    /* Serializes the checkpoints */
+    struct delayed_work ckpt_work;  /* Periodic checkpoint */
+};
+
+/* Per-CPU cursor on the chunk of the free blocks bitmap where a CPU looks for free blocks */
+struct aos_alloc_cursor {
+    uint64_t pos;               /* Next bit to be scanned */
+    uint64_t end;               /* End of the current chunk */
+};
+
 typedef struct aos_fs_info {
     struct super_block *vfs_sb; /* VFS super block structure */
     struct aos_super_block sb;  /* AOS super block structure */
-    uint64_t counter;           /* Represents the usage count of the device */
+    struct percpu_ref users;    /* Usage count of the device, killed at unmount */
+    struct completion drained;  /* Completed once the last user of a killed device is gone */
     uint64_t first;             /* First valid block written chronologically */
     uint64_t last;              /* Last valid block written chronologically */
     //---------------------------------------------------------------------------
     ulong *free_blocks;         /* Pointer to a bitmap to represent the counter of each data block */
     ulong *put_map;             /* Pointer to a bitmap to signal a pending PUT on a given block */
     ulong *inv_map;             /* Pointer to a bitmap to signal a pending PUT on a given block */
+    ulong *full_words;          /* Summary bitmap: one bit per word of the free blocks bitmap with no free block */
+    struct aos_alloc_cursor __percpu *cursors;  /* Per-CPU allocation cursors on the free blocks bitmap */
+    uint64_t next_chunk;        /* Rotor handing out bitmap chunks to the CPUs that ran out of free blocks */
+    //------------------------------------------------------------------------
+    struct aos_chain_entry *chain;  /* In-memory mirror of the chronological chain, indexed by block */
+    uint64_t chain_first;       /* First valid block in the in-memory chain (0 if empty) */
+    uint64_t chain_last;        /* Last valid block in the in-memory chain (0 if empty) */
+    seqlock_t chain_lock;       /* Protects the in-memory chain */
+    uint32_t chain_seq;         /* Publication order of the last block appended to the in-memory chain */
+    uint64_t chain_count;       /* Number of valid blocks in the in-memory chain */
+    wait_queue_head_t chain_wq; /* Readers waiting for new blocks at the end of the chain */
+    spinlock_t publish_lock;    /* Serializes the publication of completed PUTs in ticket order */
+    uint64_t put_ticket;        /* Ticket of the next block appended to the chain, taken with the journal lock */
+    uint64_t put_tail;          /* Last block of the last batch that took a ticket */
+    uint64_t pub_ticket;        /* Ticket of the next block to be published, under 'publish_lock' */
+    //------------------------------------------------------------------------
+    spinlock_t commit_lock;     /* Protects the group commit queue */
+    struct list_head commit_queue;  /* Synchronous PUTs waiting for the next group commit */
+    bool committing;            /* A group commit is being written to the device */
+    wait_queue_head_t commit_wq;    /* Synchronous PUTs waiting for the group commit in progress */
     //------------------------------------------------------------------------
-    seqlock_t *block_locks;
+    struct aos_async_put *async_ring;       /* Asynchronous PUTs, indexed by ticket modulo ASYNC_RING */
+    uint64_t async_ticket;      /* Last ticket handed out to an asynchronous PUT */
+    struct workqueue_struct *async_wq;      /* Workers executing the asynchronous PUTs */
+    //------------------------------------------------------------------------
+    seqlock_t *block_locks;     /* Seqlocks of the blocks, striped: block 'blk' is covered by 'blk & lock_mask' */
+    uint64_t lock_mask;         /* Number of stripes of the seqlocks minus one */
+    struct percpu_rw_semaphore relink_sem;  /* Excludes the updates of the chain during a relocation of blocks */
+    struct aos_journal journal; /* Metadata journal */
+    //------------------------------------------------------------------------
+    struct aos_stats __percpu *stats;   /* Per-CPU counters of the device */
+    struct kobject kobj;        /* Directory of the counters under /sys/fs/aos/ */
+    struct completion kobj_released;    /* Completed once the directory of the counters is gone */
 } aos_fs_info_t;
 
-static DECLARE_WAIT_QUEUE_HEAD(wq);
+extern aos_fs_info_t *info;
+extern uint64_t is_mounted;
+
+/*
+ * Signals a new user of the device, unless it is not mounted or its unmount already started. The RCU read section
+ * keeps 'info' alive up to the reference being taken: it is released only after a grace period following the kill.
+ * */
+static inline bool aos_get_device(void){
+    bool live;
+
+    rcu_read_lock();
+    live = READ_ONCE(is_mounted) && percpu_ref_tryget_live(&info->users);
+    rcu_read_unlock();
+
+    return live;
+}
+
+static inline void aos_put_device(void){
+    percpu_ref_put(&info->users);
+}
 #endif
 
 extern const struct inode_operations aos_inode_ops;
 extern const struct file_operations aos_file_ops;
 extern const struct file_operations aos_dir_ops;
 extern struct file_system_type aos_fs_type;
-extern uint64_t is_mounted;
 
 #endif //SOA_PROJECT_AOS_FS_H
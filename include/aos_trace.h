@@ -0,0 +1,255 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aos
+
+#if !defined(SOA_PROJECT_AOS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SOA_PROJECT_AOS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/**
+ * Tracepoints of the operations on the device, under /sys/kernel/tracing/events/aos/. Each tracepoint sits behind a
+ * static key: while it is disabled an operation only goes through a no-op, once enabled each operation emits a record
+ * that ftrace and perf can consume. The pid of the calling thread is part of every record.
+ * */
+
+TRACE_EVENT(put_start,
+    TP_PROTO(uint64_t blk, size_t size),
+    TP_ARGS(blk, size),
+    TP_STRUCT__entry(
+        __field(uint64_t, blk)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->blk = blk;
+        __entry->size = size;
+    ),
+    TP_printk("blk=%llu size=%zu", __entry->blk, __entry->size)
+);
+
+TRACE_EVENT(put_done,
+    TP_PROTO(uint64_t blk, int ret),
+    TP_ARGS(blk, ret),
+    TP_STRUCT__entry(
+        __field(uint64_t, blk)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->blk = blk;
+        __entry->ret = ret;
+    ),
+    TP_printk("blk=%llu ret=%d", __entry->blk, __entry->ret)
+);
+
+TRACE_EVENT(get,
+    TP_PROTO(uint64_t blk, size_t size, int ret),
+    TP_ARGS(blk, size, ret),
+    TP_STRUCT__entry(
+        __field(uint64_t, blk)
+        __field(size_t, size)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->blk = blk;
+        __entry->size = size;
+        __entry->ret = ret;
+    ),
+    TP_printk("blk=%llu size=%zu ret=%d", __entry->blk, __entry->size, __entry->ret)
+);
+
+TRACE_EVENT(inv,
+    TP_PROTO(uint64_t blk, int ret),
+    TP_ARGS(blk, ret),
+    TP_STRUCT__entry(
+        __field(uint64_t, blk)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->blk = blk;
+        __entry->ret = ret;
+    ),
+    TP_printk("blk=%llu ret=%d", __entry->blk, __entry->ret)
+);
+
+TRACE_EVENT(inv_range,
+    TP_PROTO(uint64_t lo, uint64_t hi, int ret),
+    TP_ARGS(lo, hi, ret),
+    TP_STRUCT__entry(
+        __field(uint64_t, lo)
+        __field(uint64_t, hi)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->lo = lo;
+        __entry->hi = hi;
+        __entry->ret = ret;
+    ),
+    TP_printk("lo=%llu hi=%llu ret=%d", __entry->lo, __entry->hi, __entry->ret)
+);
+
+/* Vectored operations: number of entries in the call and result of the call */
+DECLARE_EVENT_CLASS(aos_vec,
+    TP_PROTO(size_t count, long ret),
+    TP_ARGS(count, ret),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("count=%zu ret=%ld", __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(aos_vec, put_vec, TP_PROTO(size_t count, long ret), TP_ARGS(count, ret));
+DEFINE_EVENT(aos_vec, get_vec, TP_PROTO(size_t count, long ret), TP_ARGS(count, ret));
+DEFINE_EVENT(aos_vec, inv_vec, TP_PROTO(size_t count, long ret), TP_ARGS(count, ret));
+DEFINE_EVENT(aos_vec, put_reap, TP_PROTO(size_t count, long ret), TP_ARGS(count, ret));
+
+TRACE_EVENT(put_async,
+    TP_PROTO(uint64_t ticket, size_t size, long ret),
+    TP_ARGS(ticket, size, ret),
+    TP_STRUCT__entry(
+        __field(uint64_t, ticket)
+        __field(size_t, size)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->ticket = ticket;
+        __entry->size = size;
+        __entry->ret = ret;
+    ),
+    TP_printk("ticket=%llu size=%zu ret=%ld", __entry->ticket, __entry->size, __entry->ret)
+);
+
+TRACE_EVENT(put_async_done,
+    TP_PROTO(uint64_t ticket, long long res),
+    TP_ARGS(ticket, res),
+    TP_STRUCT__entry(
+        __field(uint64_t, ticket)
+        __field(long long, res)
+    ),
+    TP_fast_assign(
+        __entry->ticket = ticket;
+        __entry->res = res;
+    ),
+    TP_printk("ticket=%llu res=%lld", __entry->ticket, __entry->res)
+);
+
+/* Publication of a batch of 'n' blocks after 'old_last', up to 'new_last' */
+TRACE_EVENT(relink,
+    TP_PROTO(uint64_t old_last, uint64_t new_last, int n),
+    TP_ARGS(old_last, new_last, n),
+    TP_STRUCT__entry(
+        __field(uint64_t, old_last)
+        __field(uint64_t, new_last)
+        __field(int, n)
+    ),
+    TP_fast_assign(
+        __entry->old_last = old_last;
+        __entry->new_last = new_last;
+        __entry->n = n;
+    ),
+    TP_printk("old_last=%llu new_last=%llu n=%d", __entry->old_last, __entry->new_last, __entry->n)
+);
+
+TRACE_EVENT(group_commit,
+    TP_PROTO(int n),
+    TP_ARGS(n),
+    TP_STRUCT__entry(
+        __field(int, n)
+    ),
+    TP_fast_assign(
+        __entry->n = n;
+    ),
+    TP_printk("puts=%d", __entry->n)
+);
+
+TRACE_EVENT(checkpoint,
+    TP_PROTO(uint64_t seq),
+    TP_ARGS(seq),
+    TP_STRUCT__entry(
+        __field(uint64_t, seq)
+    ),
+    TP_fast_assign(
+        __entry->seq = seq;
+    ),
+    TP_printk("seq=%llu", __entry->seq)
+);
+
+TRACE_EVENT(open,
+    TP_PROTO(unsigned int flags),
+    TP_ARGS(flags),
+    TP_STRUCT__entry(
+        __field(unsigned int, flags)
+    ),
+    TP_fast_assign(
+        __entry->flags = flags;
+    ),
+    TP_printk("flags=0x%x", __entry->flags)
+);
+
+/* File pointer left by the thread closing the device file: last block read (high 32 bits) and offset in it */
+TRACE_EVENT(release,
+    TP_PROTO(loff_t pos),
+    TP_ARGS(pos),
+    TP_STRUCT__entry(
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->pos = pos;
+    ),
+    TP_printk("blk=%lld offset=%lld", __entry->pos >> 32, __entry->pos & 0xffffffff)
+);
+
+/* Read on the device file: its start, each block of the chain it copies from and its end */
+TRACE_EVENT(read_start,
+    TP_PROTO(uint64_t blk, uint64_t offset, size_t count),
+    TP_ARGS(blk, offset, count),
+    TP_STRUCT__entry(
+        __field(uint64_t, blk)
+        __field(uint64_t, offset)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->blk = blk;
+        __entry->offset = offset;
+        __entry->count = count;
+    ),
+    TP_printk("blk=%llu offset=%llu count=%zu", __entry->blk, __entry->offset, __entry->count)
+);
+
+TRACE_EVENT(read_hop,
+    TP_PROTO(uint64_t blk, int ret),
+    TP_ARGS(blk, ret),
+    TP_STRUCT__entry(
+        __field(uint64_t, blk)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->blk = blk;
+        __entry->ret = ret;
+    ),
+    TP_printk("blk=%llu ret=%d", __entry->blk, __entry->ret)
+);
+
+TRACE_EVENT(read_done,
+    TP_PROTO(ssize_t bytes),
+    TP_ARGS(bytes),
+    TP_STRUCT__entry(
+        __field(ssize_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->bytes = bytes;
+    ),
+    TP_printk("bytes=%zd", __entry->bytes)
+);
+
+#endif //SOA_PROJECT_AOS_TRACE_H
+
+/* The header is included again by CREATE_TRACE_POINTS from the directory added to the include path by the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aos_trace
+#include <trace/define_trace.h>
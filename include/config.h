@@ -5,24 +5,32 @@
 
 #define MODNAME "AOS"
 
-// Output printing configuration
+// Output printing configuration: the operations on the device are traced by the tracepoints in aos_trace.h
 #define AUDIT if(1)
-#define DEBUG if(1)
 
 // Execution restrictions
 #define WB if(0)                /* Synchronous PUT */
+#define GROUP_COMMIT            /* Synchronous PUTs of concurrent writers are written to the device together */
 #define SEQ_INV            /* The invalidation has to be guaranteed */
 //#define TIMEOUT_INV    /* The invalidation performs a few trials to overcome a possible deadlock */
 //#define RELAXED_INV          /* The invalidation that detect a conflict with other invalidations aborts */
 
 // Tunable parameters
-#define JIFFIES 100
-#define SYSCALL_TRIALS 10
+#define ALLOC_CHUNK 512         /* Number of blocks in the bitmap chunk scanned by a CPU before moving to another one */
+#define READ_AHEAD 32           /* Default number of chain blocks read ahead by 'aos_read_iter' (0: no readahead) */
+#define COMPACT_BATCH 64        /* Number of messages relocated by the compaction before letting PUTs and INVs run */
+#define ASYNC_RING 4096         /* Number of asynchronous PUTs in flight or waiting to be reaped */
+#define COMMIT_WINDOW 0         /* Microseconds a group commit waits for other synchronous PUTs to join (0: no wait) */
+#define CHECKPOINT_INTERVAL 5000    /* Milliseconds between two checkpoints of the metadata journal */
+#define RECOVERY_BATCH 256      /* Blocks read by each bio of the mount-time recovery scan */
+#define RECOVERY_WORKERS 8      /* Maximum number of workers scanning the device in parallel during a recovery */
+#define LOCK_STRIPES 64         /* Seqlocks of the blocks for each possible CPU, shared by the blocks striped on them */
 
 //MODULE_LICENSE("GPL");
 
 int register_syscalls(void);
 void unregister_syscalls(void);
+void async_put_work(struct work_struct *work);
 
 extern uint64_t is_mounted;
 
@@ -0,0 +1,19 @@
+#ifndef SOA_PROJECT_JOURNAL_H
+#define SOA_PROJECT_JOURNAL_H
+
+struct aos_commit;
+
+int journal_load(void);
+int journal_replay(void);
+void journal_free(void);
+void journal_reserve(int n);
+void journal_release(int n);
+void journal_log(uint32_t type, uint64_t blk, uint64_t prev, uint64_t next, uint64_t src, struct aos_commit *c);
+int journal_checkpoint(void);
+int recover_state(void);
+
+/* Updates of 'first' and 'last' are made under the journal lock together with the record describing them */
+#define journal_lock() spin_lock(&info->journal.lock)
+#define journal_unlock() spin_unlock(&info->journal.lock)
+
+#endif //SOA_PROJECT_JOURNAL_H
@@ -0,0 +1,68 @@
+#ifndef SOA_PROJECT_STATS_H
+#define SOA_PROJECT_STATS_H
+
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+
+/* Latencies tracked by the histograms: the operations as a whole first, then the phases they go through */
+enum aos_lat {
+    LAT_PUT,            /* put_data */
+    LAT_GET,            /* get_data */
+    LAT_INV,            /* invalidate_data */
+    LAT_READ,           /* aos_read_iter, from the first block to read */
+    LAT_ALLOC,          /* Search of free blocks in the bitmap */
+    LAT_WAIT,           /* Wait for the predecessor PUTs to be published */
+    LAT_BREAD,          /* sb_bread of a block */
+    LAT_COPY_FROM,      /* Copy of a message from user space */
+    LAT_COPY_TO,        /* Copy of a message to user space */
+    LAT_RELINK,         /* Linking of a PUT batch into the chain */
+    LAT_NR
+};
+
+#define LAT_BUCKETS 32          /* Bucket 'i' counts the latencies in [2^i, 2^(i+1)) ns; the last one also the longer */
+
+/* Log2 latency histograms of a CPU */
+struct aos_lat_hist {
+    u64 buckets[LAT_NR][LAT_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct aos_lat_hist, aos_lat);
+
+static inline u64 lat_start(void){
+    return ktime_get_ns();
+}
+
+/*
+ * Accounts the time elapsed from 'start' to the histogram 'lat' of the current CPU
+ * */
+static inline void lat_end(enum aos_lat lat, u64 start){
+    u64 ns = ktime_get_ns() - start;
+
+    this_cpu_inc(aos_lat.buckets[lat][min_t(int, ilog2(ns | 1), LAT_BUCKETS - 1)]);
+}
+
+#define STAT_ERRNOS 134         /* Errors counted by code up to EHWPOISON; the last slot also counts any higher code */
+
+/* Counters of the mounted device kept by each CPU, exported under /sys/fs/aos/<dev>/ */
+struct aos_stats {
+    u64 puts;                   /* Messages put */
+    u64 gets;                   /* Messages read by 'get_data' and 'get_data_vec' */
+    u64 invalidations;          /* Messages invalidated */
+    u64 reads;                  /* Reads of the device file */
+    u64 errors[STAT_ERRNOS];    /* Failed operations, by error code */
+    u64 seq_retries;            /* Copies of a block retried because a writer changed it meanwhile */
+    u64 put_waits;              /* PUTs that waited for the publication of a predecessor */
+    u64 alloc_collisions;       /* Free blocks lost to a concurrent PUT while being taken */
+};
+
+#define stat_inc(field) this_cpu_inc(info->stats->field)
+#define stat_add(field, n) this_cpu_add(info->stats->field, n)
+#define stat_error(err) this_cpu_inc(info->stats->errors[min_t(long, -(err), STAT_ERRNOS - 1)])
+
+void stats_init(void);
+void stats_exit(void);
+void stats_register(void);
+void stats_unregister(void);
+
+#endif //SOA_PROJECT_STATS_H
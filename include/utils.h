@@ -1,16 +1,48 @@
 #ifndef SOA_PROJECT_UTILS_H
 #define SOA_PROJECT_UTILS_H
 
+#include <linux/uio.h>
+
+#include "stats.h"
+
 #define wake_on_bit(map, bit) \
     clear_bit(bit, map);      \
     wake_up_bit(map, bit);    \
 
-int put_new_block(int blk, char* source, size_t size, int prev);
+/* Seqlock of the stripe covering the block 'blk' */
+#define block_lock(blk) (&info->block_locks[(blk) & info->lock_mask])
+
+void chain_append(uint64_t blk);
+void chain_remove(uint64_t blk);
+uint64_t chain_next(uint64_t blk);
+uint32_t chain_seq(uint64_t blk);
+uint64_t chain_next_seq(uint32_t after);
+int build_chain(void);
 int invalidate_block(int blk);
+int reserve_blocks(uint64_t *blks, int n);
+void free_block(uint64_t blk);
+void release_blocks(uint64_t *blks, int n);
+int put_payload(int blk, char* source, size_t size, struct buffer_head **bh);
+int put_new_chain(uint64_t *blks, struct buffer_head **bhs, int n);
+int invalidate_blocks(uint64_t *blks, int n);
+int compact_chain(struct aos_compact_stats *stats, struct aos_compact_move *moves, uint64_t max);
+void release_moved(struct aos_compact_move *moves, uint64_t n);
+
+/*
+ * Checks whether a copy of the block protected by 'lock' has to be retried, as a writer changed the block since 'seq'
+ * */
+static inline bool blk_retry(seqlock_t *lock, unsigned int seq){
+    if (!read_seqretry(lock, seq)) return false;
+
+    stat_inc(seq_retries);
+    return true;
+}
 
 static inline int get_blk(struct buffer_head **bh, struct super_block* sb, int blk, struct aos_data_block** db){
+    u64 start = lat_start();
 
     *bh = sb_bread(sb, blk);
+    lat_end(LAT_BREAD, start);
     if(!*bh) return -EIO;
     *db = (struct aos_data_block*)(*bh)->b_data;
 
@@ -20,17 +52,111 @@ static inline int get_blk(struct buffer_head **bh, struct super_block* sb, int b
 static inline int cpy_blk(struct super_block* sb, seqlock_t *lock, int blk, int size, struct aos_data_block* db){
     struct buffer_head *bh;
     unsigned int seq;
+    u64 start;
 
     /* Read data block into a local variable */
     do {
         seq = read_seqbegin(lock);
+        start = lat_start();
         bh = sb_bread(sb, blk);
+        lat_end(LAT_BREAD, start);
         if(!bh) return -EIO;
         memcpy(db, bh->b_data, size);
         brelse(bh);
-    } while (read_seqretry(lock, seq));
+    } while (blk_retry(lock, seq));
 
     return 0;
 }
 
+/*
+ * Copies up to 'size' bytes of the message kept by the block 'blk' straight from the buffer head to user space,
+ * without going through a local copy of the whole block. The copy is validated against the seqlock of the block as
+ * in 'cpy_blk': if a writer changed the block meanwhile, the message is copied again.
+ * */
+static inline int cpy_msg_to_user(struct super_block* sb, seqlock_t *lock, int blk, char __user *dest, size_t size){
+    struct buffer_head *bh;
+    struct aos_data_block *db;
+    unsigned int seq;
+    size_t len = 0, ret = 0;
+    u64 start;
+
+    do {
+        seq = read_seqbegin(lock);
+        start = lat_start();
+        bh = sb_bread(sb, blk);
+        lat_end(LAT_BREAD, start);
+        if(!bh) return -EIO;
+        db = (struct aos_data_block*)bh->b_data;
+
+        if (!READ_ONCE(db->metadata.is_valid)) {
+            brelse(bh);
+            if (read_seqretry(lock, seq)) continue;
+            return -ENODATA;
+        }
+
+        len = min3(size, (size_t)READ_ONCE(db->metadata.length), sizeof(db->data.msg));
+        ret = 0;
+        if (len > 0) {
+            start = lat_start();
+            ret = copy_to_user(dest, db->data.msg, len);
+            lat_end(LAT_COPY_TO, start);
+        }
+        brelse(bh);
+    } while (blk_retry(lock, seq));
+
+    return len - ret;
+}
+
+/*
+ * Copies the message kept by the block 'blk', from byte 'offset' and up to 'size' bytes, straight from the buffer head
+ * to the iterator 'to'. The copy is validated against the seqlock of the block as in 'cpy_blk': if a writer changed
+ * the block meanwhile, the iterator is reverted and the message is copied again. The length of the whole message is
+ * stored in 'length'.
+ * @return the number of bytes copied; ENODATA if the block is not valid; EFAULT if the destination is not writable.
+ * */
+static inline int cpy_msg_to_iter(struct super_block* sb, seqlock_t *lock, int blk, size_t offset, size_t size,
+                                  struct iov_iter *to, size_t *length){
+    struct buffer_head *bh;
+    struct aos_data_block *db;
+    unsigned int seq;
+    size_t len, ret;
+    u64 start;
+
+    for (;;) {
+        seq = read_seqbegin(lock);
+        start = lat_start();
+        bh = sb_bread(sb, blk);
+        lat_end(LAT_BREAD, start);
+        if(!bh) return -EIO;
+        db = (struct aos_data_block*)bh->b_data;
+
+        if (!READ_ONCE(db->metadata.is_valid)) {
+            brelse(bh);
+            if (blk_retry(lock, seq)) continue;
+            return -ENODATA;
+        }
+
+        *length = min((size_t)READ_ONCE(db->metadata.length), sizeof(db->data.msg));
+        len = (offset < *length) ? min(size, *length - offset) : 0;
+        ret = 0;
+        if (len > 0) {
+            start = lat_start();
+            ret = copy_to_iter(db->data.msg + offset, len, to);
+            lat_end(LAT_COPY_TO, start);
+        }
+        brelse(bh);
+
+        if (blk_retry(lock, seq)) {
+            iov_iter_revert(to, ret);
+            continue;
+        }
+        if (ret < len) {
+            iov_iter_revert(to, ret);
+            return -EFAULT;
+        }
+
+        return len;
+    }
+}
+
 #endif //SOA_PROJECT_UTILS_H
@@ -0,0 +1,512 @@
+#include "user.h"
+#include <getopt.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/utsname.h>
+
+#define BENCH_MAX_SIZE 4064         /* Largest message held by a block */
+#define BENCH_RING 65536            /* Blocks put by a thread and not invalidated yet that it keeps track of */
+#define SRCVERSION "/sys/module/aos/srcversion"
+
+/* Latency histograms: 2^SUB_BITS linear buckets for each power of two, i.e. a relative error of about 3% */
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS) * SUB_COUNT)
+
+enum op { OP_PUT, OP_GET, OP_INV, OP_READ, OP_NR };
+
+static const char *op_names[OP_NR] = { "put", "get", "inv", "read" };
+
+enum dist { DIST_FIXED, DIST_UNIFORM, DIST_LOGNORMAL };
+
+struct bench_thread {
+    pthread_t tid;
+    int id;
+    int cpu;                        /* CPU the thread is pinned to, -1 if not pinned */
+    long quota;                     /* Operations to run in op count mode */
+    uint64_t rng;
+    int fd;                         /* Device file of the reads */
+    char *buf;
+    uint32_t *ring;                 /* Blocks put by the thread, oldest first */
+    long ring_head, ring_count;
+    long ops[OP_NR];
+    long errors[OP_NR];
+    uint64_t max[OP_NR];
+    uint64_t *hist[OP_NR];
+};
+
+static struct {
+    int threads;
+    int mix[OP_NR];                 /* Weight of each operation */
+    int mix_tot;
+    enum dist dist;
+    double a, b;                    /* Parameters of the size distribution */
+    char *size_spec;
+    int duration;
+    long ops;                       /* Total operations; when set, the run is in op count mode */
+    int cpus[MAX_THREADS];
+    int ncpus;                      /* 0 if the threads are not pinned */
+    char *cpu_spec;
+    long read_size;
+    char *label;
+} cfg = { .threads = 1, .mix = { 50, 30, 20, 0 }, .mix_tot = 100, .dist = DIST_FIXED, .a = 64, .size_spec = "64",
+          .duration = 10, .read_size = 4096, .label = "" };
+
+static volatile int stop;
+static uint64_t max_blk;            /* Highest block returned by a PUT, for the targets of the threads with none */
+static pthread_barrier_t barrier;
+static char payload[BENCH_MAX_SIZE];
+
+static void usage(char *exe){
+    fprintf(stderr,
+            "Usage: %s [options] <PUT code> <GET code> <INVALIDATE code>\n"
+            "  -t <n>        threads (default 1)\n"
+            "  -m <mix>      op mix as weights, e.g. put=50,get=30,inv=20,read=0 (default)\n"
+            "  -s <size>     message sizes: <n>, fixed:<n>, uniform:<min>:<max> or lognormal:<median>:<sigma>\n"
+            "  -d <secs>     run for a duration (default 10)\n"
+            "  -n <ops>      run a total number of operations instead\n"
+            "  -c <cpus>     pin the threads round-robin on a CPU list, e.g. 0-3,8, or 'all'\n"
+            "  -r <bytes>    size of each read of the device file (default 4096)\n"
+            "  -l <label>    label of the run, e.g. the module build, copied to the report\n"
+            "The results are printed on stdout as JSON. The blocks put and left valid by the mix are invalidated out of\n"
+            "the measurements when a thread tracks too many of them or the device is full.\n", exe);
+}
+
+static inline uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+static inline uint64_t next_rand(struct bench_thread *t){
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double next_unit(struct bench_thread *t){
+    return (next_rand(t) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int hist_bucket(uint64_t ns){
+    int shift;
+
+    if (ns < SUB_COUNT) return ns;
+    shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + (int)((ns >> shift) - SUB_COUNT);
+}
+
+/* Highest latency accounted to a bucket */
+static uint64_t hist_value(int bucket){
+    int shift;
+
+    if (bucket < SUB_COUNT) return bucket;
+    shift = (bucket >> SUB_BITS) - 1;
+    return (((uint64_t)SUB_COUNT + (bucket & (SUB_COUNT - 1)) + 1) << shift) - 1;
+}
+
+static uint64_t hist_percentile(uint64_t *hist, long total, double p){
+    long sum = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        sum += hist[i];
+        if (sum > 0 && sum >= p * total) return hist_value(i);
+    }
+
+    return 0;
+}
+
+static long next_size(struct bench_thread *t){
+    double size, u1, u2;
+
+    switch (cfg.dist) {
+        case DIST_UNIFORM:
+            size = cfg.a + next_rand(t) % (long)(cfg.b - cfg.a + 1);
+            break;
+        case DIST_LOGNORMAL:
+            // Box-Muller
+            u1 = next_unit(t);
+            u2 = next_unit(t);
+            size = cfg.a * exp(cfg.b * sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2));
+            break;
+        default:
+            size = cfg.a;
+    }
+
+    if (size < 1) return 1;
+    return (size > BENCH_MAX_SIZE) ? BENCH_MAX_SIZE : (long)size;
+}
+
+static enum op next_op(struct bench_thread *t){
+    int w = next_rand(t) % cfg.mix_tot, op;
+
+    for (op = 0; op < OP_NR - 1; ++op) {
+        if (w < cfg.mix[op]) break;
+        w -= cfg.mix[op];
+    }
+
+    return op;
+}
+
+/* Some block that may hold a message, for a thread that put none */
+static long any_block(struct bench_thread *t){
+    uint64_t max = __atomic_load_n(&max_blk, __ATOMIC_RELAXED);
+
+    return (max < 2) ? 2 : 2 + next_rand(t) % (max - 1);
+}
+
+static long ring_pop(struct bench_thread *t){
+    long blk = t->ring[t->ring_head];
+
+    t->ring_head = (t->ring_head + 1) % BENCH_RING;
+    t->ring_count--;
+    return blk;
+}
+
+/* Invalidates the oldest block put by the thread, out of the measurements */
+static void reclaim(struct bench_thread *t){
+    if (t->ring_count) syscall(inv, ring_pop(t));
+}
+
+static void ring_push(struct bench_thread *t, long blk){
+    uint64_t max = __atomic_load_n(&max_blk, __ATOMIC_RELAXED);
+
+    while ((uint64_t)blk > max && !__atomic_compare_exchange_n(&max_blk, &max, blk, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (t->ring_count == BENCH_RING) reclaim(t);
+    t->ring[(t->ring_head + t->ring_count++) % BENCH_RING] = blk;
+}
+
+/*
+ * Runs a single operation and accounts its latency. Only the system call is timed.
+ * */
+static void run_op(struct bench_thread *t, enum op op){
+    uint64_t start, ns;
+    long ret, size, blk;
+
+    switch (op) {
+        case OP_PUT:
+            size = next_size(t);
+            start = now_ns();
+            ret = syscall(put, payload, size);
+            ns = now_ns() - start;
+            if (ret >= 0) ring_push(t, ret);
+            else if (errno == ENOMEM) reclaim(t);
+            break;
+        case OP_GET:
+            blk = t->ring_count ? t->ring[(t->ring_head + next_rand(t) % t->ring_count) % BENCH_RING] : any_block(t);
+            start = now_ns();
+            ret = syscall(get, blk, t->buf, BENCH_MAX_SIZE);
+            ns = now_ns() - start;
+            break;
+        case OP_INV:
+            blk = t->ring_count ? ring_pop(t) : any_block(t);
+            start = now_ns();
+            ret = syscall(inv, blk);
+            ns = now_ns() - start;
+            break;
+        default:
+            start = now_ns();
+            ret = read(t->fd, t->buf, cfg.read_size);
+            ns = now_ns() - start;
+            if (ret == 0) {
+                // end of the chain: start the scan over
+                close(t->fd);
+                t->fd = open(DEVICE_PATH, O_RDONLY);
+            }
+    }
+
+    t->ops[op]++;
+    if (ret < 0) t->errors[op]++;
+    if (ns > t->max[op]) t->max[op] = ns;
+    t->hist[op][hist_bucket(ns)]++;
+}
+
+void* bench_loop(void *arg){
+    struct bench_thread *t = (struct bench_thread*)arg;
+    cpu_set_t set;
+    long i;
+
+    if (t->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            fprintf(stderr, "[%d] - couldn't pin the thread on CPU %d\n", t->id, t->cpu);
+    }
+
+    pthread_barrier_wait(&barrier);
+
+    if (cfg.ops) {
+        for (i = 0; i < t->quota; ++i) run_op(t, next_op(t));
+    } else {
+        while (!stop) run_op(t, next_op(t));
+    }
+
+    pthread_exit(0);
+}
+
+static int parse_mix(char *spec){
+    char *s = strdup(spec), *tok, *save, *val;
+    int op, w;
+
+    memset(cfg.mix, 0, sizeof(cfg.mix));
+    cfg.mix_tot = 0;
+
+    for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) goto fail;
+        *val++ = '\0';
+
+        for (op = 0; op < OP_NR && strcmp(tok, op_names[op]); ++op);
+        w = strtol(val, NULL, 10);
+        if (op == OP_NR || w < 0) goto fail;
+
+        cfg.mix[op] = w;
+        cfg.mix_tot += w;
+    }
+
+    free(s);
+    return cfg.mix_tot > 0 ? 0 : -1;
+
+fail:
+    free(s);
+    return -1;
+}
+
+static int parse_size(char *spec){
+    cfg.size_spec = spec;
+
+    if (sscanf(spec, "uniform:%lf:%lf", &cfg.a, &cfg.b) == 2) {
+        cfg.dist = DIST_UNIFORM;
+        return (cfg.a >= 1 && cfg.b >= cfg.a && cfg.b <= BENCH_MAX_SIZE) ? 0 : -1;
+    }
+    if (sscanf(spec, "lognormal:%lf:%lf", &cfg.a, &cfg.b) == 2) {
+        cfg.dist = DIST_LOGNORMAL;
+        return (cfg.a >= 1 && cfg.b >= 0) ? 0 : -1;
+    }
+    if (sscanf(spec, "fixed:%lf", &cfg.a) == 1 || sscanf(spec, "%lf", &cfg.a) == 1) {
+        cfg.dist = DIST_FIXED;
+        return (cfg.a >= 1 && cfg.a <= BENCH_MAX_SIZE) ? 0 : -1;
+    }
+
+    return -1;
+}
+
+static int parse_cpus(char *spec){
+    char *s, *tok, *save;
+    int lo, hi, n;
+
+    cfg.cpu_spec = spec;
+    cfg.ncpus = 0;
+
+    if (!strcmp(spec, "all")) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (lo = 0; lo < n && cfg.ncpus < MAX_THREADS; ++lo) cfg.cpus[cfg.ncpus++] = lo;
+        return 0;
+    }
+
+    s = strdup(spec);
+    for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        n = sscanf(tok, "%d-%d", &lo, &hi);
+        if (n == 1) hi = lo;
+        if (n < 1 || lo < 0 || hi < lo) {
+            free(s);
+            return -1;
+        }
+        for (; lo <= hi && cfg.ncpus < MAX_THREADS; ++lo) cfg.cpus[cfg.ncpus++] = lo;
+    }
+    free(s);
+
+    return cfg.ncpus > 0 ? 0 : -1;
+}
+
+/* Prints a string as a JSON value */
+static void print_json_str(char *s){
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        if ((unsigned char)*s >= 0x20) putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_report(struct bench_thread *threads, double secs){
+    struct utsname uts;
+    char srcversion[64] = "";
+    uint64_t *hist, max;
+    long ops, errors, tot = 0;
+    int i, j, op;
+    FILE *f;
+
+    uname(&uts);
+    f = fopen(SRCVERSION, "r");
+    if (f) {
+        if (!fgets(srcversion, sizeof(srcversion), f)) srcversion[0] = '\0';
+        srcversion[strcspn(srcversion, "\n")] = '\0';
+        fclose(f);
+    }
+
+    hist = malloc(HIST_BUCKETS * sizeof(uint64_t));
+    if (!hist) {
+        perror("Malloc failed.");
+        return;
+    }
+
+    printf("{\n  \"label\": ");
+    print_json_str(cfg.label);
+    printf(",\n  \"kernel\": ");
+    print_json_str(uts.release);
+    printf(",\n  \"module_srcversion\": ");
+    print_json_str(srcversion);
+    printf(",\n  \"config\": {\"threads\": %d, \"mix\": {", cfg.threads);
+    for (op = 0; op < OP_NR; ++op) printf("%s\"%s\": %d", op ? ", " : "", op_names[op], cfg.mix[op]);
+    printf("}, \"size\": ");
+    print_json_str(cfg.size_spec);
+    if (cfg.ops) printf(", \"ops\": %ld", cfg.ops);
+    else printf(", \"duration_s\": %d", cfg.duration);
+    printf(", \"cpus\": ");
+    print_json_str(cfg.ncpus ? cfg.cpu_spec : "");
+    printf(", \"read_size\": %ld},\n", cfg.read_size);
+    printf("  \"elapsed_s\": %.6f,\n  \"ops\": {\n", secs);
+
+    for (op = 0; op < OP_NR; ++op) {
+        memset(hist, 0, HIST_BUCKETS * sizeof(uint64_t));
+        for (ops = 0, errors = 0, max = 0, i = 0; i < cfg.threads; ++i) {
+            ops += threads[i].ops[op];
+            errors += threads[i].errors[op];
+            if (threads[i].max[op] > max) max = threads[i].max[op];
+            for (j = 0; j < HIST_BUCKETS; ++j) hist[j] += threads[i].hist[op][j];
+        }
+        tot += ops;
+
+        printf("    \"%s\": {\"ops\": %ld, \"errors\": %ld, \"ops_per_s\": %.1f, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+               "\"p999_ns\": %lu, \"max_ns\": %lu}%s\n", op_names[op], ops, errors, ops / secs,
+               hist_percentile(hist, ops, 0.5), hist_percentile(hist, ops, 0.99), hist_percentile(hist, ops, 0.999),
+               max, (op < OP_NR - 1) ? "," : "");
+    }
+
+    printf("  },\n  \"total\": {\"ops\": %ld, \"ops_per_s\": %.1f}\n}\n", tot, tot / secs);
+    free(hist);
+}
+
+/*
+ * Runs a mix of concurrent PUT, GET, INVALIDATE and device file reads, for a duration or a number of operations,
+ * and reports the throughput and the latency percentiles of each operation as JSON.
+ * */
+int main(int argc, char *argv[]){
+    struct bench_thread *threads, *t;
+    uint64_t start, end;
+    int c, i, op;
+
+    while ((c = getopt(argc, argv, "t:m:s:d:n:c:r:l:h")) != -1) {
+        switch (c) {
+            case 't':
+                cfg.threads = strtol(optarg, NULL, 10);
+                if (cfg.threads < 1 || cfg.threads > MAX_THREADS) goto bad_option;
+                break;
+            case 'm':
+                if (parse_mix(optarg)) goto bad_option;
+                break;
+            case 's':
+                if (parse_size(optarg)) goto bad_option;
+                break;
+            case 'd':
+                cfg.duration = strtol(optarg, NULL, 10);
+                if (cfg.duration < 1) goto bad_option;
+                break;
+            case 'n':
+                cfg.ops = strtol(optarg, NULL, 10);
+                if (cfg.ops < 1) goto bad_option;
+                break;
+            case 'c':
+                if (parse_cpus(optarg)) goto bad_option;
+                break;
+            case 'r':
+                cfg.read_size = strtol(optarg, NULL, 10);
+                if (cfg.read_size < 1) goto bad_option;
+                break;
+            case 'l':
+                cfg.label = optarg;
+                break;
+            default:
+                goto bad_option;
+        }
+    }
+
+    // check_input expects the system call codes from argv[1]
+    if (argc - optind < 3) goto bad_option;
+    if (check_input(argc - optind + 1, argv + optind - 1)) return -1;
+
+    for (i = 0; i < BENCH_MAX_SIZE; ++i) payload[i] = lorem[i % (SIZE_LOREM - 1)];
+
+    threads = calloc(cfg.threads, sizeof(struct bench_thread));
+    if (!threads) {
+        perror("Malloc failed.");
+        return -1;
+    }
+
+    for (i = 0; i < cfg.threads; ++i) {
+        t = threads + i;
+        t->id = i;
+        t->cpu = cfg.ncpus ? cfg.cpus[i % cfg.ncpus] : -1;
+        t->quota = cfg.ops / cfg.threads + (i < cfg.ops % cfg.threads);
+        t->rng = (uint64_t)time(NULL) * 2654435761ULL + i + 1;
+        t->fd = -1;
+        if (cfg.mix[OP_READ]) {
+            t->fd = open(DEVICE_PATH, O_RDONLY);
+            if (t->fd < 0) {
+                perror("Open of the device file failed.");
+                return -1;
+            }
+        }
+        t->buf = malloc(cfg.read_size > BENCH_MAX_SIZE ? cfg.read_size : BENCH_MAX_SIZE);
+        t->ring = malloc(BENCH_RING * sizeof(uint32_t));
+        if (!t->buf || !t->ring) {
+            perror("Malloc failed.");
+            return -1;
+        }
+        for (op = 0; op < OP_NR; ++op) {
+            t->hist[op] = calloc(HIST_BUCKETS, sizeof(uint64_t));
+            if (!t->hist[op]) {
+                perror("Malloc failed.");
+                return -1;
+            }
+        }
+    }
+
+    pthread_barrier_init(&barrier, NULL, cfg.threads+1);
+    for (i = 0; i < cfg.threads; ++i) pthread_create(&threads[i].tid, NULL, bench_loop, (void *)(threads+i));
+
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    if (!cfg.ops) {
+        sleep(cfg.duration);
+        stop = 1;
+    }
+    for (i = 0; i < cfg.threads; ++i) pthread_join(threads[i].tid, NULL);
+    end = now_ns();
+    pthread_barrier_destroy(&barrier);
+
+    print_report(threads, (end - start) / 1e9);
+
+    // leave the device as it was found
+    for (i = 0; i < cfg.threads; ++i) {
+        t = threads + i;
+        while (t->ring_count) reclaim(t);
+        if (t->fd >= 0) close(t->fd);
+        for (op = 0; op < OP_NR; ++op) free(t->hist[op]);
+        free(t->ring);
+        free(t->buf);
+    }
+    free(threads);
+
+    return 0;
+
+bad_option:
+    usage(argv[0]);
+    return -1;
+}
@@ -0,0 +1,87 @@
+#include "user.h"
+
+#define BENCH_MSG_SIZE 4000
+
+/*
+ * Scrambles the chain with rounds of PUTs and invalidations, then scans the device with a cold page cache before
+ * and after a compaction, reporting the scan throughput and the number of non-sequential hops of the chain.
+ * */
+int main(int argc, char *argv[]){
+    struct aos_compact_stats stats;
+    struct aos_compact_move *map;
+    char msg[BENCH_MSG_SIZE], *buf;
+    long ns_before, ns_after, tot_before, tot_after, size = 4 * 1024 * 1024;
+    int *blks, ret, fd, n, i, cap = 1024;
+
+    if (check_input(argc, argv)) return -1;
+
+    memset(msg, 'a', BENCH_MSG_SIZE-1);
+    msg[BENCH_MSG_SIZE-1] = '\0';
+
+    blks = malloc(cap * sizeof(int));
+    buf = malloc(size);
+    if (!blks || !buf) {
+        perror("Malloc failed.");
+        return -1;
+    }
+
+    /* Fill the device, then invalidate every other message and fill it again: the new messages are interleaved with
+     * the old ones on the device, while they follow all of them in the chain */
+    printf("Scrambling the chain with %d bytes messages...\n", BENCH_MSG_SIZE);
+    for (n = 0;; ++n) {
+        ret = syscall(put, msg, BENCH_MSG_SIZE-1);
+        if (ret < 0) break;
+
+        if (n == cap) {
+            cap *= 2;
+            blks = realloc(blks, cap * sizeof(int));
+            if (!blks) {
+                perror("Realloc failed.");
+                return -1;
+            }
+        }
+        blks[n] = ret;
+    }
+    for (i = 0; i < n; i += 2) syscall(inv, blks[i]);
+    while (syscall(put, msg, BENCH_MSG_SIZE-1) >= 0);
+
+    /* Every message can be moved twice: out of the way of another one, then in place */
+    map = malloc(2 * n * sizeof(struct aos_compact_move));
+    if (!map) {
+        perror("Malloc failed.");
+        return -1;
+    }
+    stats.map = (uintptr_t)map;
+    stats.map_len = 2 * n;
+
+    ns_before = cold_scan(buf, size, &tot_before);
+    if (ns_before < 0) return -1;
+
+    fd = open(DEVICE_PATH, O_RDONLY);
+    if (fd < 0) {
+        check_error(fd, "Open");
+        return -1;
+    }
+    ret = ioctl(fd, AOS_IOC_COMPACT, &stats);
+    close(fd);
+    if (ret < 0) {
+        check_error(0, "Compact");
+        return -1;
+    }
+
+    ns_after = cold_scan(buf, size, &tot_after);
+    if (ns_after < 0) return -1;
+
+    printf("%-10s %15s %15s %15s\n", "", "breaks", "ms", "MB/s");
+    printf("%-10s %15lu %15.2f %15.2f\n", "before", stats.breaks_before, ns_before / 1e6,
+           (tot_before / 1e6) / (ns_before / 1e9));
+    printf("%-10s %15lu %15.2f %15.2f\n", "after", stats.breaks_after, ns_after / 1e6,
+           (tot_after / 1e6) / (ns_after / 1e9));
+    printf("%lu messages relocated\n", stats.moved);
+
+    free(map);
+    free(blks);
+    free(buf);
+
+    return 0;
+}
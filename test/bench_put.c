@@ -0,0 +1,90 @@
+#include "user.h"
+#include <time.h>
+
+#define BENCH_MSG_SIZE 64
+#define BENCH_BUCKETS 11        /* One bucket per 10% of fill level, plus the last 1% */
+
+static inline long elapsed_ns(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Fills an empty device with PUTs until it runs out of free blocks, then reports the PUT latency observed at
+ * each fill level, so that the cost of the free block lookup can be checked from an empty to a full device.
+ * */
+int main(int argc, char *argv[]){
+    struct timespec start, end;
+    long *lat, *tmp, sum[BENCH_BUCKETS] = {0}, max[BENCH_BUCKETS] = {0};
+    int cnt[BENCH_BUCKETS] = {0};
+    int ret, n, cap, i, b;
+    char msg[BENCH_MSG_SIZE];
+
+    if (check_input(argc, argv)) return -1;
+
+    memset(msg, 'a', BENCH_MSG_SIZE-1);
+    msg[BENCH_MSG_SIZE-1] = '\0';
+
+    cap = 1024;
+    lat = malloc(cap * sizeof(long));
+    if (!lat) {
+        perror("Malloc failed.");
+        return -1;
+    }
+
+    printf("Filling the device with %d bytes messages...\n", BENCH_MSG_SIZE);
+    for (n = 0;; ++n) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = syscall(put, msg, BENCH_MSG_SIZE-1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (ret < 0) {
+            if (errno != ENOMEM) {
+                check_error(0, "PUT");
+                free(lat);
+                return -1;
+            }
+            break; // device full
+        }
+
+        if (n == cap) {
+            cap *= 2;
+            tmp = realloc(lat, cap * sizeof(long));
+            if (!tmp) {
+                perror("Realloc failed.");
+                free(lat);
+                return -1;
+            }
+            lat = tmp;
+        }
+        lat[n] = elapsed_ns(&start, &end);
+    }
+
+    if (n == 0) {
+        printf("No free block on the device.\n");
+        free(lat);
+        return 0;
+    }
+
+    /* Group the latencies by the fill level of the device when the PUT was issued */
+    for (i = 0; i < n; ++i) {
+        b = (i * 100L) / n;
+        b = (b >= 99) ? BENCH_BUCKETS-1 : b / 10;
+        sum[b] += lat[i];
+        cnt[b]++;
+        if (lat[i] > max[b]) max[b] = lat[i];
+    }
+
+    printf("%d PUTs completed before the device was full.\n", n);
+    printf("%-12s %10s %12s %12s\n", "fill level", "puts", "mean (ns)", "max (ns)");
+    for (b = 0; b < BENCH_BUCKETS; ++b) {
+        if (!cnt[b]) continue;
+        if (b == BENCH_BUCKETS-1) {
+            printf("%-12s %10d %12ld %12ld\n", "[99%, 100%)", cnt[b], sum[b]/cnt[b], max[b]);
+        } else {
+            printf("[%2d%%, %3d%%)  %10d %12ld %12ld\n", b*10, (b == 9) ? 99 : (b+1)*10, cnt[b], sum[b]/cnt[b], max[b]);
+        }
+    }
+
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "user.h"
+#include <time.h>
+
+#define BENCH_MSG_SIZE 64
+#define BENCH_SECONDS 2
+
+static volatile int stop;
+static pthread_barrier_t barrier;
+static char msg[BENCH_MSG_SIZE];
+
+/*
+ * Puts messages until the round is over, invalidating each block right after the PUT so that the device never
+ * fills up. Only the time spent in PUT is accounted to the thread.
+ * */
+void* put_loop(void *arg){
+    long *puts = (long*)arg;
+    int ret;
+
+    pthread_barrier_wait(&barrier);
+
+    while (!stop) {
+        ret = syscall(put, msg, BENCH_MSG_SIZE-1);
+        if (ret < 0) {
+            if (errno == ENOMEM) continue;
+            check_error(0, "PUT");
+            break;
+        }
+        (*puts)++;
+
+        syscall(inv, ret);
+    }
+
+    pthread_exit(0);
+}
+
+/*
+ * Runs rounds of concurrent PUTs with a doubling number of threads, up to the number of online CPUs,
+ * and reports the PUT throughput of each round.
+ * */
+int main(int argc, char *argv[]){
+    pthread_t tids[MAX_THREADS];
+    long puts[MAX_THREADS], tot;
+    struct timespec start, end;
+    double secs;
+    int i, nthreads, ncpus;
+
+    if (check_input(argc, argv)) return -1;
+
+    memset(msg, 'a', BENCH_MSG_SIZE-1);
+    msg[BENCH_MSG_SIZE-1] = '\0';
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > MAX_THREADS) ncpus = MAX_THREADS;
+
+    printf("%-10s %15s %15s\n", "threads", "puts", "puts/s");
+    for (nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+        stop = 0;
+        pthread_barrier_init(&barrier, NULL, nthreads+1);
+
+        for (i = 0; i < nthreads; ++i) {
+            puts[i] = 0;
+            pthread_create(&tids[i], NULL, put_loop, (void *)(puts+i));
+        }
+
+        pthread_barrier_wait(&barrier);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sleep(BENCH_SECONDS);
+        stop = 1;
+
+        for (tot = 0, i = 0; i < nthreads; ++i) {
+            pthread_join(tids[i], NULL);
+            tot += puts[i];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_barrier_destroy(&barrier);
+
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-10d %15ld %15.0f\n", nthreads, tot, tot / secs);
+    }
+
+    return 0;
+}
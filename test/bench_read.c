@@ -0,0 +1,61 @@
+#include "user.h"
+#include <time.h>
+
+#define BENCH_MSG_SIZE 4000
+#define READ_AHEAD_PARAM "/sys/module/aos/parameters/read_ahead"
+
+static int windows[] = {0, 4, 16, 32, 64, 256};
+
+/*
+ * Fills the device with PUTs, then scans it through the device file with a cold page cache for each readahead
+ * window, reporting the scan throughput.
+ * */
+int main(int argc, char *argv[]){
+    char msg[BENCH_MSG_SIZE], *buf;
+    long ns, tot, size = 4 * 1024 * 1024;
+    int ret, n, i;
+
+    if (check_input(argc, argv)) return -1;
+
+    memset(msg, 'a', BENCH_MSG_SIZE-1);
+    msg[BENCH_MSG_SIZE-1] = '\0';
+
+    printf("Filling the device with %d bytes messages...\n", BENCH_MSG_SIZE);
+    for (n = 0;; ++n) {
+        ret = syscall(put, msg, BENCH_MSG_SIZE-1);
+        if (ret < 0) {
+            if (errno != ENOMEM) {
+                check_error(0, "PUT");
+                return -1;
+            }
+            break; // device full
+        }
+    }
+    printf("%d messages put\n", n);
+
+    buf = malloc(size);
+    if (!buf) {
+        perror("Malloc failed.");
+        return -1;
+    }
+
+    printf("%-12s %15s %15s %15s\n", "read_ahead", "bytes", "ms", "MB/s");
+    for (i = 0; i < sizeof(windows)/sizeof(int); ++i) {
+        char val[16];
+
+        snprintf(val, sizeof(val), "%d", windows[i]);
+        if (write_file(READ_AHEAD_PARAM, val)) {
+            perror("Could not set the readahead window");
+            break;
+        }
+
+        ns = cold_scan(buf, size, &tot);
+        if (ns < 0) break;
+
+        printf("%-12d %15ld %15.2f %15.2f\n", windows[i], tot, ns / 1e6, (tot / 1e6) / (ns / 1e9));
+    }
+
+    free(buf);
+
+    return 0;
+}
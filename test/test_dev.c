@@ -8,6 +8,9 @@ int main(){
            "\t[1] ST Open-Read-Close\n"
            "\t[2] ST Open-(Multi)Read-Close\n"
            "\t[3] MT Open-Read-Close\n"
+           "\t[4] ST Open-Follow-Close (blocking reads)\n"
+           "\t[5] ST Open-Follow-Close (poll)\n"
+           "\t[6] ST Open-Splice-Close\n"
            "\t[other] Exit\n");
 
     switch(getint()){
@@ -21,6 +24,15 @@ int main(){
             for (i = 0; i < THREADS_PER_CALL; ++i) pthread_create(&tids[i], NULL, multi_orc, NULL);
             for (i = 0; i < THREADS_PER_CALL; ++i) pthread_join(tids[i], NULL);
             break;
+        case 4:
+            follow(0);
+            break;
+        case 5:
+            follow(1);
+            break;
+        case 6:
+            osc();
+            break;
         default:
             break;
     }
@@ -10,6 +10,11 @@ int main(int argc, char *argv[]){
                "\t[1] Put data\n"
                "\t[2] Get data\n"
                "\t[3] Invalidate data\n"
+               "\t[4] Put a batch of data\n"
+               "\t[5] Get a batch of data\n"
+               "\t[6] Invalidate a batch of data\n"
+               "\t[7] Invalidate a range of blocks\n"
+               "\t[8] Put data asynchronously\n"
                "\t[other] Exit\n");
 
         switch(getint()){
@@ -22,6 +27,21 @@ int main(int argc, char *argv[]){
             case 3:
                 test_invalidate_data();
                 break;
+            case 4:
+                test_put_data_vec();
+                break;
+            case 5:
+                test_get_data_vec();
+                break;
+            case 6:
+                test_invalidate_data_vec();
+                break;
+            case 7:
+                test_invalidate_range();
+                break;
+            case 8:
+                test_put_data_async();
+                break;
             default:
                 return 0;
         }
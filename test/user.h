@@ -10,14 +10,38 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
 
 #define DEVICE_PATH "../fs/mount/the-device"
+#define DROP_CACHES "/proc/sys/vm/drop_caches"
 #define NBLOCKS 10
 #define DEVICE_SIZE (4096 * NBLOCKS)
-#define NUM_SYSCALLS 3
 #define THREADS_PER_CALL 10
+#define MAX_THREADS 256
 #define MAX_INT 5
 #define MAX_STR 4096
+#define MAX_VEC 1024
+#define PUT_VEC_ATOMIC 0x1
+#define AOS_IOC_FOLLOW _IO('A', 1)
+#define AOS_IOC_COMPACT _IOWR('A', 2, struct aos_compact_stats)
+
+struct aos_compact_move {
+    uint64_t from;
+    uint64_t to;
+};
+
+struct aos_compact_stats {
+    uint64_t map;
+    uint64_t map_len;
+    uint64_t moved;
+    uint64_t breaks_before;
+    uint64_t breaks_after;
+};
 
 #define SIZE_LOREM 447
 #define SIZE_EMERALD 1023
@@ -64,25 +88,35 @@ static char lucifer[SIZE_LUCIFER] =
 extern int put;
 extern int get;
 extern int inv;
+extern int put_vec;
+extern int get_vec;
+extern int inv_vec;
+extern int inv_range;
+extern int put_async;
+extern int put_reap;
 
 int check_input(int argc, char **argv);
 int getint();
 char* getstr();
 void check_error(int tid, char* call);
+int write_file(char *path, char *val);
+long cold_scan(char *buf, long size, long *tot);
 
 // single thread
 void test_put_data();
 void test_get_data();
 void test_invalidate_data();
-
-// multi thread
-void* multi_put_data(void *arg);
-void* multi_get_data(void *arg);
-void* multi_invalidate_data(void *arg);
+void test_put_data_vec();
+void test_get_data_vec();
+void test_invalidate_data_vec();
+void test_invalidate_range();
+void test_put_data_async();
 
 // device
 void orc();
 void orc_fp();
 void* multi_orc();
+void follow(int use_poll);
+void osc();
 
 #endif //SOA_PROJECT_USER_H
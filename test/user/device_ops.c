@@ -93,3 +93,100 @@ void* multi_orc(){
     orc();
     pthread_exit(0);
 }
+
+void follow(int use_poll){
+    struct pollfd pfd;
+    int fd, ret, msgs, i;
+    char buf[MAX_STR];
+
+    printf("How many reads do you want to wait for? ");
+    msgs = getint();
+
+    printf("1. Opening the device in follow mode... ");
+    fd = open(DEVICE_PATH, use_poll ? O_RDONLY | O_NONBLOCK : O_RDONLY);
+    if (fd < 0) {
+        check_error(fd, "Open");
+        return;
+    }
+    if (ioctl(fd, AOS_IOC_FOLLOW, 1) < 0) {
+        check_error(fd, "Ioctl");
+        close(fd);
+        return;
+    }
+    printf("OK\n");
+
+    printf("2. Following the device (PUT new messages from another terminal)...\n");
+    for (i = 0; i < msgs; ++i) {
+        if (use_poll) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            ret = poll(&pfd, 1, -1);
+            if (ret < 0 || (pfd.revents & POLLERR)) {
+                check_error(fd, "Poll");
+                break;
+            }
+        }
+
+        ret = read(fd, buf, MAX_STR-1);
+        if (ret < 0) {
+            if (errno == EAGAIN) continue;
+            check_error(fd, "Read");
+            break;
+        }
+        buf[ret] = '\0';
+        printf("\t%d bytes read. Retrieved messages are: %s\n", ret, buf);
+    }
+
+    printf("3. Closing the device... ");
+    ret = close(fd);
+    if (ret < 0) {
+        check_error(fd, "Close");
+    } else {
+        printf("OK\n");
+    }
+}
+
+void osc(){
+    int fd, pfd[2], ret, tot;
+    char buf[MAX_STR];
+
+    printf("Starting device splice tests...\n");
+
+    printf("1. Opening the device... ");
+    fd = open(DEVICE_PATH, O_RDONLY);
+    if (fd < 0) {
+        check_error(fd, "Open");
+        return;
+    }
+    if (pipe(pfd) < 0) {
+        perror("Pipe failed.");
+        close(fd);
+        return;
+    }
+    printf("OK\n");
+
+    printf("2. Splicing the device into a pipe...\n");
+    tot = 0;
+    while ((ret = splice(fd, NULL, pfd[1], NULL, MAX_STR, 0)) > 0) {
+        tot += ret;
+        ret = read(pfd[0], buf, ret);
+        if (ret < 0) {
+            perror("Pipe read failed.");
+            break;
+        }
+        printf("\t%d bytes spliced. Retrieved messages are: %.*s\n", ret, ret, buf);
+    }
+    if (ret < 0) check_error(fd, "Splice");
+    printf("%d bytes spliced in total\n", tot);
+
+    close(pfd[0]);
+    close(pfd[1]);
+
+    printf("3. Closing the device... ");
+    ret = close(fd);
+    if (ret < 0) {
+        check_error(fd, "Close");
+    } else {
+        printf("OK\n");
+    }
+}
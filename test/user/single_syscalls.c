@@ -85,4 +85,181 @@ void test_invalidate_data(){
     } else {
         printf("Block %d invalidated.\n", block);
     }
+}
+
+void test_put_data_vec(){
+    struct iovec vec[MAX_VEC];
+    int64_t offsets[MAX_VEC];
+    int ret, count, flags, i;
+
+    printf("How many messages do you want to put? ");
+    count = getint();
+    if (count < 1 || count > MAX_VEC) {
+        printf("The number of messages must be between 1 and %d\n", MAX_VEC);
+        return;
+    }
+    printf("Should the batch be put all or nothing [0/1]? ");
+    flags = getint() ? PUT_VEC_ATOMIC : 0;
+
+    for (i = 0; i < count; ++i) {
+        vec[i].iov_base = msgs[i%3];
+        vec[i].iov_len = strlen(msgs[i%3]);
+    }
+
+    ret = syscall(put_vec, vec, count, offsets, flags);
+    if(ret < 0) {
+        check_error(0, "PUT VEC");
+        return;
+    }
+
+    printf("%d messages of %d correctly written\n", ret, count);
+    for (i = 0; i < count; ++i) {
+        if (offsets[i] < 0) {
+            printf("\t[%d] failed with error %ld\n", i, -offsets[i]);
+        } else {
+            printf("\t[%d] written in block %ld\n", i, offsets[i]);
+        }
+    }
+}
+
+void test_get_data_vec() {
+    uint64_t offsets[MAX_VEC];
+    int64_t lengths[MAX_VEC];
+    int ret, size, count, block, i;
+    char *msg, *pos;
+
+    printf("Which block do you want to start reading from (indexes starts from 2)? ");
+    block = getint();
+    printf("How many consecutive blocks do you want to read? ");
+    count = getint();
+    if (count < 1 || count > MAX_VEC) {
+        printf("The number of blocks must be between 1 and %d\n", MAX_VEC);
+        return;
+    }
+    printf("How many bytes do you want to read in total? ");
+    size = getint();
+
+    msg = malloc(size);
+    if (!msg) {
+        perror("malloc failed.");
+        return;
+    }
+
+    for (i = 0; i < count; ++i) offsets[i] = block + i;
+
+    ret = syscall(get_vec, offsets, count, msg, size, lengths);
+    if(ret < 0) {
+        check_error(0, "GET VEC");
+        free(msg);
+        return;
+    }
+
+    printf("Retrieved %d bytes\n", ret);
+    pos = msg;
+    for (i = 0; i < count; ++i) {
+        if (lengths[i] < 0) {
+            printf("\t[%lu] failed with error %ld\n", offsets[i], -lengths[i]);
+        } else {
+            printf("\t[%lu] %ld bytes: \"%.*s\"\n", offsets[i], lengths[i], (int)lengths[i], pos);
+            pos += lengths[i];
+        }
+    }
+
+    free(msg);
+}
+
+void test_invalidate_data_vec(){
+    uint64_t offsets[MAX_VEC];
+    int ret, count, i;
+
+    printf("How many blocks do you want to invalidate? ");
+    count = getint();
+    if (count < 1 || count > MAX_VEC) {
+        printf("The number of blocks must be between 1 and %d\n", MAX_VEC);
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        printf("Block %d (indexes starts from 2)? ", i);
+        offsets[i] = getint();
+    }
+
+    ret = syscall(inv_vec, offsets, count);
+    if(ret < 0) {
+        check_error(0, "INV VEC");
+    } else {
+        printf("%d blocks invalidated.\n", ret);
+    }
+}
+
+void test_invalidate_range(){
+    int ret, lo, hi;
+
+    printf("First block of the range (indexes starts from 2)? ");
+    lo = getint();
+    printf("First block after the range? ");
+    hi = getint();
+
+    ret = syscall(inv_range, lo, hi);
+    if(ret < 0) {
+        check_error(0, "INV RANGE");
+    } else {
+        printf("%d blocks invalidated in [%d, %d).\n", ret, lo, hi);
+    }
+}
+void test_put_data_async(){
+    int64_t tickets[MAX_VEC];
+    int64_t results[MAX_VEC];
+    uint64_t completed, events;
+    int ret, count, efd, i;
+
+    printf("How many messages do you want to put asynchronously? ");
+    count = getint();
+    if (count < 1 || count > MAX_VEC) {
+        printf("The number of messages must be between 1 and %d\n", MAX_VEC);
+        return;
+    }
+
+    efd = eventfd(0, 0);
+    if (efd < 0) {
+        perror("eventfd failed.");
+        return;
+    }
+
+    /* Submit every message without waiting */
+    for (i = 0; i < count; ++i) {
+        tickets[i] = syscall(put_async, msgs[i%3], strlen(msgs[i%3]), efd);
+        if (tickets[i] < 0) {
+            check_error(0, "PUT ASYNC");
+            count = i;
+            break;
+        }
+    }
+    printf("%d messages submitted\n", count);
+
+    /* Wait for every completion to be signalled */
+    for (completed = 0; completed < count; completed += events) {
+        if (read(efd, &events, sizeof(events)) != sizeof(events)) {
+            perror("eventfd read failed.");
+            break;
+        }
+    }
+
+    if (count > 0) {
+        ret = syscall(put_reap, tickets, count, results);
+        if (ret < 0) {
+            check_error(0, "PUT REAP");
+        } else {
+            printf("%d messages of %d completed\n", ret, count);
+            for (i = 0; i < count; ++i) {
+                if (results[i] < 0) {
+                    printf("\t[ticket %ld] failed with error %ld\n", tickets[i], -results[i]);
+                } else {
+                    printf("\t[ticket %ld] written in block %ld\n", tickets[i], results[i]);
+                }
+            }
+        }
+    }
+
+    close(efd);
 }
\ No newline at end of file
@@ -3,6 +3,12 @@
 int put;
 int get;
 int inv;
+int put_vec = -1;
+int get_vec = -1;
+int inv_vec = -1;
+int inv_range = -1;
+int put_async = -1;
+int put_reap = -1;
 
 char* getstr(){
     char* msg = malloc(MAX_STR);
@@ -37,7 +43,9 @@ int check_input(int argc, char *argv[]){
     int ret;
 
     if (argc < 4) {
-        printf("Usage: <exe> <PUT code> <GET code> <INVALIDATE code>");
+        printf("Usage: <exe> <PUT code> <GET code> <INVALIDATE code> "
+               "[<PUT VEC code> <GET VEC code> <INVALIDATE VEC code> <INVALIDATE RANGE code> "
+               "<PUT ASYNC code> <PUT REAP code>]");
         return -1;
     }
 
@@ -55,6 +63,42 @@ int check_input(int argc, char *argv[]){
     ret = syscall(inv, -1);
     if(ret == -1 && errno == ENOSYS) printf("Test to INVALIDATE returned with error. System call not installed.\n");
 
+    if (argc > 4) {
+        put_vec = strtol(argv[4], NULL, 10);
+        ret = syscall(put_vec, NULL, 0, NULL, 0);
+        if(ret == -1 && errno == ENOSYS) printf("Test to PUT VEC returned with error. System call not installed.\n");
+    }
+
+    if (argc > 5) {
+        get_vec = strtol(argv[5], NULL, 10);
+        ret = syscall(get_vec, NULL, 0, NULL, 0, NULL);
+        if(ret == -1 && errno == ENOSYS) printf("Test to GET VEC returned with error. System call not installed.\n");
+    }
+
+    if (argc > 6) {
+        inv_vec = strtol(argv[6], NULL, 10);
+        ret = syscall(inv_vec, NULL, 0);
+        if(ret == -1 && errno == ENOSYS) printf("Test to INVALIDATE VEC returned with error. System call not installed.\n");
+    }
+
+    if (argc > 7) {
+        inv_range = strtol(argv[7], NULL, 10);
+        ret = syscall(inv_range, 0, 0);
+        if(ret == -1 && errno == ENOSYS) printf("Test to INVALIDATE RANGE returned with error. System call not installed.\n");
+    }
+
+    if (argc > 8) {
+        put_async = strtol(argv[8], NULL, 10);
+        ret = syscall(put_async, NULL, -1, -1);
+        if(ret == -1 && errno == ENOSYS) printf("Test to PUT ASYNC returned with error. System call not installed.\n");
+    }
+
+    if (argc > 9) {
+        put_reap = strtol(argv[9], NULL, 10);
+        ret = syscall(put_reap, NULL, 0, NULL);
+        if(ret == -1 && errno == ENOSYS) printf("Test to PUT REAP returned with error. System call not installed.\n");
+    }
+
     return 0;
 }
 
@@ -78,5 +122,60 @@ void check_error(int tid, char* call){
         case EAGAIN:
             printf("[%s, %d] - Try again.\n", call, tid);
             break;
+        case EFAULT:
+            printf("[%s, %d] - Bad user-space address.\n", call, tid);
+            break;
     }
+}
+/*
+ * Writes the string 'val' in the file 'path'
+ * */
+int write_file(char *path, char *val){
+    int fd, ret;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0) return -1;
+    ret = write(fd, val, strlen(val));
+    close(fd);
+
+    return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * Reads the whole device through the device file with reads of 'size' bytes, after emptying the page cache.
+ * The number of bytes read is stored in 'tot'.
+ * @return the elapsed time in ns; -1 on error
+ * */
+long cold_scan(char *buf, long size, long *tot){
+    struct timespec start, end;
+    int fd, ret;
+
+    sync();
+    if (write_file(DROP_CACHES, "3")) {
+        perror("Could not drop the page cache (root is needed)");
+        return -1;
+    }
+
+    fd = open(DEVICE_PATH, O_RDONLY);
+    if (fd < 0) {
+        check_error(fd, "Open");
+        return -1;
+    }
+
+    *tot = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        ret = read(fd, buf, size);
+        if (ret < 0) {
+            check_error(fd, "Read");
+            close(fd);
+            return -1;
+        }
+        *tot += ret;
+    } while (ret > 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    close(fd);
+
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
 }
\ No newline at end of file
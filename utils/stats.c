@@ -0,0 +1,242 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+
+#include "../include/config.h"
+#include "../include/aos_fs.h"
+#include "../include/stats.h"
+
+/**
+ * This module exports the statistics of the device:
+ *  - the per-CPU latency histograms of the operations under /sys/kernel/debug/aos/, one file per histogram. Reading
+ *    a file sums the histogram over every CPU; writing anything to it resets the histogram.
+ *  - the per-CPU counters of the mounted device under /sys/fs/aos/<dev>/, one file per counter, together with the
+ *    free blocks and the length of the chain. Reading a file sums the counter over every CPU.
+ * */
+
+extern aos_fs_info_t *info;
+
+DEFINE_PER_CPU(struct aos_lat_hist, aos_lat);
+
+static const char *lat_names[LAT_NR] = {
+    [LAT_PUT] = "put",
+    [LAT_GET] = "get",
+    [LAT_INV] = "inv",
+    [LAT_READ] = "read",
+    [LAT_ALLOC] = "alloc",
+    [LAT_WAIT] = "wait",
+    [LAT_BREAD] = "bread",
+    [LAT_COPY_FROM] = "copy_from_user",
+    [LAT_COPY_TO] = "copy_to_user",
+    [LAT_RELINK] = "relink",
+};
+
+static struct dentry *stats_dir;
+static struct kobject *stats_kobj;     /* /sys/fs/aos/ */
+
+/*
+ * Prints the non-empty buckets of a histogram, with the total number of samples and the buckets holding the median
+ * and the 99th percentile
+ * */
+static int lat_show(struct seq_file *m, void *v){
+    enum aos_lat lat = (long)m->private;
+    u64 counts[LAT_BUCKETS] = { 0 };
+    u64 total = 0, sum = 0;
+    int cpu, i, p50 = -1, p99 = -1;
+
+    for_each_possible_cpu(cpu) {
+        for (i = 0; i < LAT_BUCKETS; ++i) counts[i] += READ_ONCE(per_cpu(aos_lat, cpu).buckets[lat][i]);
+    }
+    for (i = 0; i < LAT_BUCKETS; ++i) total += counts[i];
+
+    seq_printf(m, "%-14s %-14s %s\n", "from(ns)", "to(ns)", "count");
+    for (i = 0; i < LAT_BUCKETS; ++i) {
+        if (counts[i] == 0) continue;
+
+        sum += counts[i];
+        if (p50 < 0 && sum * 2 >= total) p50 = i;
+        if (p99 < 0 && sum * 100 >= total * 99) p99 = i;
+        seq_printf(m, "%-14llu %-14llu %llu\n", 1ULL << i, 1ULL << (i + 1), counts[i]);
+    }
+
+    seq_printf(m, "total %llu", total);
+    if (total) seq_printf(m, " p50 < %llu ns p99 < %llu ns", 1ULL << (p50 + 1), 1ULL << (p99 + 1));
+    seq_putc(m, '\n');
+
+    return 0;
+}
+
+static int lat_open(struct inode *inode, struct file *file){
+    return single_open(file, lat_show, inode->i_private);
+}
+
+/*
+ * Resets the histogram on every CPU. Samples accounted meanwhile may survive the reset
+ * */
+static ssize_t lat_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos){
+    enum aos_lat lat = (long)((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu(aos_lat, cpu).buckets[lat], 0, sizeof(per_cpu(aos_lat, cpu).buckets[lat]));
+    }
+
+    return count;
+}
+
+static const struct file_operations lat_fops = {
+    .owner = THIS_MODULE,
+    .open = lat_open,
+    .read = seq_read,
+    .write = lat_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* Sums the per-CPU counter at byte 'offset' of 'struct aos_stats' over every CPU */
+static u64 stat_sum(aos_fs_info_t *fs_info, size_t offset){
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) sum += READ_ONCE(*(u64 *)((char *)per_cpu_ptr(fs_info->stats, cpu) + offset));
+
+    return sum;
+}
+
+/* Attribute of a per-CPU counter, at byte 'offset' of 'struct aos_stats' */
+struct stat_attr {
+    struct kobj_attribute attr;
+    size_t offset;
+};
+
+static ssize_t stat_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    aos_fs_info_t *fs_info = container_of(kobj, aos_fs_info_t, kobj);
+
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", stat_sum(fs_info, container_of(attr, struct stat_attr, attr)->offset));
+}
+
+#define STAT_ATTR(name) \
+    static struct stat_attr stat_attr_##name = { __ATTR(name, 0444, stat_show, NULL), offsetof(struct aos_stats, name) }
+
+STAT_ATTR(puts);
+STAT_ATTR(gets);
+STAT_ATTR(invalidations);
+STAT_ATTR(reads);
+STAT_ATTR(seq_retries);
+STAT_ATTR(put_waits);
+STAT_ATTR(alloc_collisions);
+
+/* One line for each error code that occurred: the code and the number of failed operations */
+static ssize_t errors_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    aos_fs_info_t *fs_info = container_of(kobj, aos_fs_info_t, kobj);
+    ssize_t len = 0;
+    u64 count;
+    int err;
+
+    for (err = 1; err < STAT_ERRNOS; ++err) {
+        count = stat_sum(fs_info, offsetof(struct aos_stats, errors[err]));
+        if (count) len += scnprintf(buf + len, PAGE_SIZE - len, "%d %llu\n", -err, count);
+    }
+
+    return len;
+}
+
+static ssize_t free_blocks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    aos_fs_info_t *fs_info = container_of(kobj, aos_fs_info_t, kobj);
+    uint64_t nblocks = fs_info->sb.partition_size;
+
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", nblocks - bitmap_weight(fs_info->free_blocks, nblocks));
+}
+
+static ssize_t chain_length_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    aos_fs_info_t *fs_info = container_of(kobj, aos_fs_info_t, kobj);
+
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", READ_ONCE(fs_info->chain_count));
+}
+
+static struct kobj_attribute errors_attr = __ATTR_RO(errors);
+static struct kobj_attribute free_blocks_attr = __ATTR_RO(free_blocks);
+static struct kobj_attribute chain_length_attr = __ATTR_RO(chain_length);
+
+static struct attribute *stat_attrs[] = {
+    &stat_attr_puts.attr.attr,
+    &stat_attr_gets.attr.attr,
+    &stat_attr_invalidations.attr.attr,
+    &stat_attr_reads.attr.attr,
+    &errors_attr.attr,
+    &free_blocks_attr.attr,
+    &chain_length_attr.attr,
+    &stat_attr_seq_retries.attr.attr,
+    &stat_attr_put_waits.attr.attr,
+    &stat_attr_alloc_collisions.attr.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(stat);
+
+static void stats_release(struct kobject *kobj){
+    aos_fs_info_t *fs_info = container_of(kobj, aos_fs_info_t, kobj);
+
+    complete(&fs_info->kobj_released);
+}
+
+static struct kobj_type stats_ktype = {
+    .sysfs_ops = &kobj_sysfs_ops,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+    .default_groups = stat_groups,
+#else
+    .default_attrs = stat_attrs,
+#endif
+    .release = stats_release,
+};
+
+/**
+ * Creates the directory of the counters of the mounted device, /sys/fs/aos/<dev>/. The counters keep being updated
+ * if it cannot be created.
+ * */
+void stats_register(void){
+    int res;
+
+    init_completion(&info->kobj_released);
+    if (!stats_kobj) return;
+
+    res = kobject_init_and_add(&info->kobj, &stats_ktype, stats_kobj, "%s", info->vfs_sb->s_id);
+    if (res < 0) {
+        printk(KERN_ALERT "%s: [stats_register()] couldn't create /sys/fs/aos/%s (error %d)\n", MODNAME,
+               info->vfs_sb->s_id, res);
+        kobject_put(&info->kobj);
+        wait_for_completion(&info->kobj_released);
+    }
+}
+
+/**
+ * Removes the directory of the counters of the mounted device, waiting for the readers of its files to leave
+ * */
+void stats_unregister(void){
+    if (!info->kobj.state_in_sysfs) return;
+
+    kobject_del(&info->kobj);
+    kobject_put(&info->kobj);
+    wait_for_completion(&info->kobj_released);
+}
+
+/**
+ * Creates the histogram files under /sys/kernel/debug/aos/ and the /sys/fs/aos/ directory of the counters of the
+ * mounted devices. As usual for debugfs and sysfs statistics, a failure only leaves them unexported.
+ * */
+void stats_init(void){
+    long lat;
+
+    stats_dir = debugfs_create_dir("aos", NULL);
+    for (lat = 0; lat < LAT_NR; ++lat) debugfs_create_file(lat_names[lat], 0600, stats_dir, (void *)lat, &lat_fops);
+
+    stats_kobj = kobject_create_and_add("aos", fs_kobj);
+    if (!stats_kobj) printk(KERN_ALERT "%s: [stats_init()] couldn't create /sys/fs/aos\n", MODNAME);
+}
+
+void stats_exit(void){
+    kobject_put(stats_kobj);
+    debugfs_remove_recursive(stats_dir);
+}
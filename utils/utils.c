@@ -1,149 +1,744 @@
 #include <linux/seqlock.h>
 #include <linux/buffer_head.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <linux/blkdev.h>
+#include <linux/delay.h>
 
 #include "../include/config.h"
 #include "../include/aos_fs.h"
 #include "../include/utils.h"
+#include "../include/journal.h"
+#include "../include/aos_trace.h"
 
 extern aos_fs_info_t *info;
 
+/**
+ * Appends the block 'blk' to the in-memory chain. Called once the block is linked on the device, in the same order.
+ * */
+void chain_append(uint64_t blk){
+    write_seqlock(&info->chain_lock);
+
+    info->chain[blk].prev = info->chain_last;
+    info->chain[blk].next = 0;
+    info->chain[blk].seq = ++info->chain_seq;
+    if (info->chain_last) {
+        info->chain[info->chain_last].next = blk;
+    } else {
+        info->chain_first = blk;
+    }
+    info->chain_last = blk;
+    info->chain_count++;
+
+    write_sequnlock(&info->chain_lock);
+
+    if (wq_has_sleeper(&info->chain_wq)) wake_up_interruptible_all(&info->chain_wq);
+}
+
+/**
+ * Removes the invalidated block 'blk' from the in-memory chain. Its own successor is left untouched, so that a reader
+ * currently positioned on the block can still move forward.
+ * */
+void chain_remove(uint64_t blk){
+    uint64_t prev, next;
+
+    write_seqlock(&info->chain_lock);
+
+    prev = info->chain[blk].prev;
+    next = info->chain[blk].next;
+
+    /* Nothing to do if the block is not linked */
+    if ((prev && info->chain[prev].next != blk) || (!prev && info->chain_first != blk)) {
+        write_sequnlock(&info->chain_lock);
+        return;
+    }
+
+    if (prev) {
+        info->chain[prev].next = next;
+    } else {
+        info->chain_first = next;
+    }
+    if (next) {
+        info->chain[next].prev = prev;
+    } else {
+        info->chain_last = prev;
+    }
+    info->chain_count--;
+
+    write_sequnlock(&info->chain_lock);
+}
+
+/**
+ * Returns the valid block following 'blk' in the in-memory chain, or the first valid block if 'blk' is 0.
+ * @return the index of the block; 0 if there is none
+ * */
+uint64_t chain_next(uint64_t blk){
+    unsigned int seq;
+    uint64_t next;
+
+    do {
+        seq = read_seqbegin(&info->chain_lock);
+        next = (blk == 0) ? info->chain_first : info->chain[blk].next;
+    } while (read_seqretry(&info->chain_lock, seq));
+
+    return next;
+}
+
+/**
+ * Returns the publication order of the block 'blk' in the in-memory chain.
+ * */
+uint32_t chain_seq(uint64_t blk){
+    unsigned int seq;
+    uint32_t ret;
+
+    do {
+        seq = read_seqbegin(&info->chain_lock);
+        ret = info->chain[blk].seq;
+    } while (read_seqretry(&info->chain_lock, seq));
+
+    return ret;
+}
+
+/**
+ * Returns the first valid block published after the block of publication order 'after', walking the in-memory chain
+ * backwards from its end: the cost is proportional to the number of blocks published since then, and the result does
+ * not depend on the block of order 'after' being still valid.
+ * @return the index of the block; 0 if there is none
+ * */
+uint64_t chain_next_seq(uint32_t after){
+    unsigned int seq;
+    uint64_t blk, next, steps;
+
+    do {
+        seq = read_seqbegin(&info->chain_lock);
+
+        next = 0;
+        blk = info->chain_last;
+        for (steps = 0; blk != 0 && (int32_t)(info->chain[blk].seq - after) > 0; ++steps) {
+            if (steps == info->sb.partition_size) break; // inconsistent snapshot: retried
+            next = blk;
+            blk = info->chain[blk].prev;
+        }
+    } while (read_seqretry(&info->chain_lock, seq));
+
+    return next;
+}
+
+static int take_block(uint64_t blk);
+
+/**
+ * Builds the in-memory chain at mount time, following the chain kept on the device from 'first' and linking only
+ * the blocks that keep valid data.
+ * 'last' is taken from the chain walked: the links of a PUT may reach the device without its journal record, leaving
+ * the replayed 'last' behind the actual tail.
+ * The free blocks bitmap is brought in line with the chain: the valid blocks are taken and the invalid ones are given
+ * back, as the bitmap saved by the last checkpoint may lag behind an invalidation. The blocks taken out of the chain,
+ * such as the ones reserved by PUTs that had not been logged yet when the checkpoint was taken, are given back too.
+ * @return 0 on success; EINVAL if the chain is corrupted, leaving the data area or going through a block twice, so that
+ *         the state can be recovered from the blocks instead.
+ * */
+int build_chain(void){
+    struct buffer_head *bh;
+    struct aos_data_block *data_block;
+    uint64_t blk, tail = 1, nblocks = info->sb.partition_size;
+    ulong *walked;
+    int res = 0, steps;
+
+    info->chain_first = info->chain_last = 0;
+    info->chain_count = 0;
+    info->chain_seq = 0;
+    seqlock_init(&info->chain_lock);
+    init_waitqueue_head(&info->chain_wq);
+    spin_lock_init(&info->publish_lock);
+
+    walked = kvzalloc(BITS_TO_LONGS(nblocks) * sizeof(long), GFP_KERNEL);
+    if (!walked) return -ENOMEM;
+
+    for (blk = info->first, steps = 0; blk != 0 && steps < nblocks; ++steps) {
+        /* A block met twice closes a cycle, that would make the in-memory chain endless */
+        if (blk < 2 || blk >= nblocks || test_bit(blk, walked)) { // corrupted chain
+            res = -EINVAL;
+            goto out;
+        }
+
+        res = get_blk(&bh, info->vfs_sb, blk, &data_block);
+        if (res < 0) goto out;
+
+        set_bit(blk, walked);
+        if (data_block->metadata.is_valid) {
+            take_block(blk);
+            chain_append(blk);
+        } else {
+            free_block(blk);
+        }
+        tail = blk;
+        blk = data_block->metadata.next;
+
+        brelse(bh);
+    }
+
+    if (tail == 1) info->first = 0;
+    info->last = tail;
+
+    /* No PUT is pending yet: a block taken out of the chain is not referenced by anyone */
+    for (blk = find_next_bit(info->free_blocks, nblocks, 2); blk < nblocks;
+         blk = find_next_bit(info->free_blocks, nblocks, blk + 1)) {
+        if (!test_bit(blk, walked)) free_block(blk);
+    }
+
+    out:
+        kvfree(walked);
+        return res;
+}
+
+/*
+ * Keeps the dirty buffer 'bh' in the synchronous PUT 'c', if any, so that it is written on the device together with
+ * the payloads of the PUT; otherwise the buffer is just released.
+ * */
+static inline void commit_add(struct aos_commit *c, struct buffer_head *bh){
+    if (c) {
+        c->bhs[c->n++] = bh;
+    } else {
+        brelse(bh);
+    }
+}
+
 /*
  * Opens the block with index 'blk' and updates the metadata pointing to its successor with 'next'.
+ * Called with the stripe of 'blk' locked.
  * */
-static int change_block_next(int blk, int next){
+static int change_block_next(int blk, int next, struct aos_commit *c){
     struct buffer_head *bh_prev;
     struct aos_data_block *prev_block;
     int fail;
 
-    write_seqlock(&info->block_locks[blk]);
-
     fail = get_blk(&bh_prev, info->vfs_sb, blk, &prev_block);
-    if (fail < 0) {
-        write_sequnlock(&info->block_locks[blk]);
-        return fail;
-    }
+    if (fail < 0) return fail;
 
     prev_block->metadata.next = next;
 
     mark_buffer_dirty(bh_prev);
-    brelse(bh_prev);
-
-    write_sequnlock(&info->block_locks[blk]);
+    commit_add(c, bh_prev);
 
     return fail;
 }
 
 /*
  * Opens the block with index 'blk' and updates the metadata pointing to its predecessor with 'prev'.
+ * Called with the stripe of 'blk' locked.
  * */
-static int change_block_prev(int blk, int prev) {
+static int change_block_prev(int blk, int prev, struct aos_commit *c) {
     struct buffer_head *bh_next;
     struct aos_data_block *next_block;
     int fail;
 
-    write_seqlock(&info->block_locks[blk]);
-
     fail = get_blk(&bh_next, info->vfs_sb, blk, &next_block);
-    if (fail < 0) {
-        write_sequnlock(&info->block_locks[blk]);
-        return fail;
-    }
+    if (fail < 0) return fail;
+
     next_block->metadata.prev = prev;
 
     mark_buffer_dirty(bh_next);
-    brelse(bh_next);
-
-    write_sequnlock(&info->block_locks[blk]);
+    commit_add(c, bh_next);
 
     return fail;
 }
 
-static inline int put_blk(int old_last, int size, char* source, struct buffer_head *bh, struct aos_data_block *data_block){
-    size_t ret;
+/*
+ * Locks the stripes of the blocks 'a', 'b' and 'c' in ascending order, each one once even if shared by more blocks,
+ * so that two writers locking overlapping sets of stripes cannot deadlock.
+ * @return the number of stripes locked, stored in 'stripes'
+ * */
+static int lock_stripes(uint64_t *stripes, uint64_t a, uint64_t b, uint64_t c){
+    uint64_t s[3] = { a & info->lock_mask, b & info->lock_mask, c & info->lock_mask };
+    int i, n = 0;
 
-    /* Get the message from user */
-    ret = copy_from_user(data_block->data.msg, source, size);
-    size -= ret;
+    if (s[0] > s[1]) swap(s[0], s[1]);
+    if (s[1] > s[2]) swap(s[1], s[2]);
+    if (s[0] > s[1]) swap(s[0], s[1]);
 
-    /* Write the message on the block */
-    data_block->data.msg[size+1] = '\0';
-    data_block->metadata.is_valid = 1;
-    data_block->metadata.prev = old_last;
-    data_block->metadata.next = 0;
+    for (i = 0; i < 3; ++i) {
+        if (n == 0 || s[i] != stripes[n-1]) stripes[n++] = s[i];
+    }
+    for (i = 0; i < n; ++i) write_seqlock(&info->block_locks[stripes[i]]);
 
-    /* Update the block on the device */
-    mark_buffer_dirty(bh);
-    WB { sync_dirty_buffer(bh); } // immediate synchronous write on the device
+    return n;
+}
 
-    return size;
+static void unlock_stripes(uint64_t *stripes, int n){
+    while (n-- > 0) write_sequnlock(&info->block_locks[stripes[n]]);
 }
 
-/**
- * Inserts a new message in the given block, updating its metadata
+/*
+ * Removes the block 'blk', about to be reused, from the position it held in the chain before being invalidated,
+ * linking its old predecessor and successor together, and detaches it.
+ * The block and its two neighbours are updated with their stripes locked together; as the unlink of a neighbouring
+ * block may change the links of 'blk' before they are locked, the links are read again once they are. One journal
+ * record is logged, out of the ones reserved by the caller.
  * */
-int put_new_block(int blk, char* source, size_t size, int old_last){
-    struct buffer_head *bh;
-    struct aos_data_block *data_block;
-    int res, old_first;
+static int unlink_block(int blk, struct aos_data_block *data_block, struct aos_commit *c){
+    uint64_t stripes[3];
     uint64_t prev, next;
+    int n, res = 0;
 
-    if (old_last == 1) { /* The block is the first to be inserted: no need to lock */
-        old_first = __atomic_exchange_n(&info->first, blk, __ATOMIC_RELAXED);
+    for (;;) {
+        prev = READ_ONCE(data_block->metadata.prev);
+        next = READ_ONCE(data_block->metadata.next);
+        n = lock_stripes(stripes, blk, prev, next);
+        if (data_block->metadata.prev == prev && data_block->metadata.next == next) break;
+        unlock_stripes(stripes, n);
+    }
 
-        write_seqlock(&info->block_locks[blk]);
+    /* A block freed while still at the end of the chain (by a failed PUT, or as the predecessor of an invalidated last
+     * block) can still be 'last': like an invalidation, 'last' goes back to its predecessor, so that the block is never
+     * appended after itself */
+    journal_lock();
+    (__sync_bool_compare_and_swap(&info->first, blk, next)) ?
+    __sync_bool_compare_and_swap(&info->last, blk, 1) : __sync_bool_compare_and_swap(&info->last, blk, prev);
+    journal_log(JR_UNLINK, blk, prev, next, 0, c);
+    journal_unlock();
 
-        res = get_blk(&bh, info->vfs_sb, blk, &data_block);
-        if (res < 0) goto failure_2;
+    if (next != 0) {
+        if (prev != 1) res = change_block_next(prev, next, c);
+        if (res == 0) res = change_block_prev(next, prev, c);
+    }
 
-    } else {
-        /* Wait for the previous PUT to complete to update the metadata */
-        res = wait_on_bit(info->put_map, old_last, TASK_INTERRUPTIBLE);
-        if (res) return -EBUSY;
+    if (res == 0) data_block->metadata.next = 0; // detached: a later reuse must not relink anything
 
-        write_seqlock(&info->block_locks[blk]);
+    unlock_stripes(stripes, n);
 
-        res = get_blk(&bh, info->vfs_sb, blk, &data_block);
-        if(res < 0) goto failure_1;
+    return res;
+}
 
-        prev = data_block->metadata.prev;
-        next = data_block->metadata.next;
+/*
+ * Finds the first free block in ['start', 'end'), skipping through the summary bitmap the words of the free blocks
+ * bitmap that have no free block.
+ * @return the index of the free block; 'end' if there is none
+ * */
+static uint64_t find_free_block(uint64_t start, uint64_t end){
+    uint64_t word, bit, bound;
+    uint64_t word_end = BITS_TO_LONGS(end);
 
-        __sync_bool_compare_and_swap(&info->first, blk, next);
+    while (start < end) {
+        word = find_next_zero_bit(info->full_words, word_end, BIT_WORD(start));
+        if (word >= word_end) break;
 
-        if (next != 0) {
-            if (prev != 1) {
-                res = change_block_next(prev, next);
-                if (res < 0) {
-                    brelse(bh);
-                    goto failure_1;
-                }
-            }
+        bit = max_t(uint64_t, start, word * BITS_PER_LONG);
+        bound = min_t(uint64_t, end, (word + 1) * BITS_PER_LONG);
+        bit = find_next_zero_bit(info->free_blocks, bound, bit);
+        if (bit < bound) return bit;
 
-            res = change_block_prev(next, prev);
-            if (res < 0) {
-                brelse(bh);
-                goto failure_1;
-            }
+        start = bound;
+    }
+
+    return end;
+}
+
+/*
+ * Sets the bit of the block 'blk' in the free blocks bitmap, keeping the summary bitmap in sync.
+ * The summary bit is set when the word gets full and checked again afterwards, so that a block concurrently
+ * freed in the same word is never hidden by the summary.
+ * @return the old value of the bit
+ * */
+static int take_block(uint64_t blk){
+    ulong *word = &info->free_blocks[BIT_WORD(blk)];
+
+    if (test_and_set_bit(blk, info->free_blocks)) return 1;
+
+    if (READ_ONCE(*word) == ~0UL) {
+        set_bit(BIT_WORD(blk), info->full_words);
+        smp_mb__after_atomic();
+        if (READ_ONCE(*word) != ~0UL) clear_bit(BIT_WORD(blk), info->full_words);
+    }
+
+    return 0;
+}
+
+/**
+ * Clears the bit of the block 'blk' in the free blocks bitmap, keeping the summary bitmap in sync
+ * */
+void free_block(uint64_t blk){
+    clear_bit(blk, info->free_blocks);
+    smp_mb__after_atomic();
+    clear_bit(BIT_WORD(blk), info->full_words);
+}
+
+/*
+ * Moves an allocation cursor to a new chunk of the bitmap that still has free blocks.
+ * The scan starts from the chunk handed out by a shared rotor, so that concurrent CPUs usually scan different bitmap
+ * words. A chunk is not owned by the CPU that got it: another CPU may scan it too, and the test and set of the bits
+ * decides which PUT takes each block. Once every chunk was scanned without a free block, the device is full.
+ * @return 1 if a chunk with free blocks was found, 0 otherwise
+ * */
+static int refill_cursor(struct aos_alloc_cursor *cursor, uint64_t nblocks){
+    uint64_t nchunks = DIV_ROUND_UP(nblocks, ALLOC_CHUNK);
+    uint64_t i, first, start, end, free;
+
+    /* One chunk is taken from the rotor, then the following ones are scanned in order: concurrent refills moving the
+     * rotor meanwhile cannot make the scan skip any chunk */
+    first = __sync_fetch_and_add(&info->next_chunk, 1);
+    for (i = 0; i < nchunks; ++i) {
+        start = ((first + i) % nchunks) * ALLOC_CHUNK;
+        end = min_t(uint64_t, start + ALLOC_CHUNK, nblocks);
+
+        free = find_free_block(start, end);
+        if (free < end) {
+            cursor->pos = free;
+            cursor->end = end;
+            return 1;
         }
+        cond_resched();
+    }
 
-        res = change_block_next(old_last, blk);
-        if (res < 0) {
-            brelse(bh);
-            goto failure_1;
+    return 0;
+}
+
+/**
+ * Reserves up to 'n' free blocks, storing their indexes in 'blks'.
+ * Each CPU resumes the scan of the free blocks bitmap from its own cursor, moving to a new chunk only when the current
+ * one runs dry: the search does not restart from the first bit at each call.
+ * The scan runs with preemption enabled on a copy of the cursor, which is only a hint on where to look: if the thread
+ * migrates meanwhile, the cursor is stored on the new CPU. Test and set is used to skip the blocks concurrently taken
+ * by other PUTs without restarting the scan.
+ * @return the number of reserved blocks
+ * */
+int reserve_blocks(uint64_t *blks, int n){
+    struct aos_alloc_cursor cursor, *cpu_cursor;
+    uint64_t block_index;
+    uint64_t nblocks = info->sb.partition_size;
+    int found = 0;
+    u64 start = lat_start();
+
+    cpu_cursor = raw_cpu_ptr(info->cursors);
+    cursor.pos = READ_ONCE(cpu_cursor->pos);
+    cursor.end = READ_ONCE(cpu_cursor->end);
+
+    while (found < n) {
+        if (cursor.pos >= cursor.end && !refill_cursor(&cursor, nblocks)) break; // no more free blocks
+
+        block_index = find_free_block(cursor.pos, cursor.end);
+        cursor.pos = block_index + 1;
+        if (block_index >= cursor.end) continue; // chunk exhausted
+
+        if (!take_block(block_index)) {
+            blks[found++] = block_index;
+        } else {
+            stat_inc(alloc_collisions); // taken by a concurrent PUT since it was found free
         }
     }
 
-    size = put_blk(old_last, size, source, bh, data_block);
+    cpu_cursor = raw_cpu_ptr(info->cursors);
+    WRITE_ONCE(cpu_cursor->pos, cursor.pos);
+    WRITE_ONCE(cpu_cursor->end, cursor.end);
 
-    brelse(bh);
-    write_sequnlock(&info->block_locks[blk]);
+    lat_end(LAT_ALLOC, start);
+
+    return found;
+}
+
+/*
+ * Gives back to the free blocks bitmap 'n' blocks reserved by 'reserve_blocks'
+ * */
+void release_blocks(uint64_t *blks, int n){
+    int i;
+
+    for (i = 0; i < n; ++i) free_block(blks[i]);
+}
+
+/**
+ * Copies 'size' bytes of user data into the payload of a reserved block that is not linked in the chain yet.
+ * Since the block is still invalid, readers skip its content and no lock is needed.
+ * The buffer head is left in 'bh' so that the block can be linked without being read again.
+ * @return the number of bytes written; EFAULT if the user data could not be copied entirely.
+ * */
+int put_payload(int blk, char* source, size_t size, struct buffer_head **bh){
+    struct aos_data_block *data_block;
+    u64 start;
+    int res;
+
+    res = get_blk(bh, info->vfs_sb, blk, &data_block);
+    if (res < 0) return res;
+
+    start = lat_start();
+    res = copy_from_user(data_block->data.msg, source, size);
+    lat_end(LAT_COPY_FROM, start);
+    if (res) {
+        brelse(*bh);
+        return -EFAULT;
+    }
+    data_block->metadata.length = size;
 
     return size;
+}
 
-    failure_2:
-        __sync_val_compare_and_swap(&info->first, blk, old_first); // reset 'first'
-    failure_1:
-        write_sequnlock(&info->block_locks[blk]);
+#ifdef GROUP_COMMIT
+/*
+ * Writes the dirty buffers of every synchronous PUT in 'group' with a single plug, so that the block layer can merge
+ * and dispatch them together, then waits for all of them and records the outcome of each PUT.
+ * */
+static void write_group(struct list_head *group){
+    struct aos_commit *c;
+    struct blk_plug plug;
+    int i, n = 0;
+
+    blk_start_plug(&plug);
+    list_for_each_entry(c, group, list) {
+        for (i = 0; i < c->n; ++i) write_dirty_buffer(c->bhs[i], REQ_SYNC); // clean buffers are skipped
+        n++;
+    }
+    blk_finish_plug(&plug);
+
+    list_for_each_entry(c, group, list) {
+        c->err = 0;
+        for (i = 0; i < c->n; ++i) {
+            wait_on_buffer(c->bhs[i]);
+            if (!buffer_uptodate(c->bhs[i])) c->err = -EIO;
+        }
+    }
+
+    trace_group_commit(n);
+}
+
+/*
+ * Writes on the device the dirty buffers of the synchronous PUT 'c' through a group commit.
+ * The PUT joins the queue of the current commit window: if no commit is in progress the caller becomes the leader,
+ * takes every queued PUT and writes them together; otherwise it waits for the leader to write its buffers, or to
+ * finish the previous window so that it can lead the next one. Concurrent synchronous PUTs thus share the device
+ * writes instead of flushing one message at a time.
+ * @return 0 once the buffers are stable on the device; EIO if any of them could not be written.
+ * */
+static int commit_put(struct aos_commit *c){
+    struct aos_commit *p, *tmp;
+    LIST_HEAD(group);
+
+    c->done = false;
+
+    spin_lock(&info->commit_lock);
+    list_add_tail(&c->list, &info->commit_queue);
+
+    while (!c->done) {
+        if (info->committing) {
+            spin_unlock(&info->commit_lock);
+            wait_event(info->commit_wq, READ_ONCE(c->done) || !READ_ONCE(info->committing));
+            spin_lock(&info->commit_lock);
+            continue;
+        }
+
+        /* Lead the commit of the PUTs queued so far */
+        info->committing = true;
+        list_splice_init(&info->commit_queue, &group);
+        spin_unlock(&info->commit_lock);
+
+        if (COMMIT_WINDOW) {
+            usleep_range(COMMIT_WINDOW, 2 * COMMIT_WINDOW);
+            spin_lock(&info->commit_lock);
+            list_splice_tail_init(&info->commit_queue, &group);
+            spin_unlock(&info->commit_lock);
+        }
+
+        write_group(&group);
+
+        /* The entries of the other PUTs must not be accessed once they are done, as they live on their stacks */
+        spin_lock(&info->commit_lock);
+        list_for_each_entry_safe(p, tmp, &group, list) {
+            list_del(&p->list);
+            p->done = true;
+        }
+        info->committing = false;
+        wake_up_all(&info->commit_wq);
+    }
+
+    spin_unlock(&info->commit_lock);
+
+    return c->err;
+}
+#else
+/*
+ * Writes on the device the dirty buffers of the synchronous PUT 'c', one at a time.
+ * @return 0 once the buffers are stable on the device; EIO if any of them could not be written.
+ * */
+static int commit_put(struct aos_commit *c){
+    int i;
+
+    c->err = 0;
+    for (i = 0; i < c->n; ++i) {
+        if (sync_dirty_buffer(c->bhs[i])) c->err = -EIO;
+    }
+    c->done = true;
+
+    return c->err;
+}
+#endif
+
+/*
+ * Publishes, in ticket order, the blocks starting from 'blk': each one is appended to the in-memory chain and its
+ * pending PUT is signalled as complete. The batches that completed while waiting behind the published ones follow.
+ * Called with 'publish_lock' held.
+ * */
+static void publish_from(uint64_t blk){
+    uint64_t next;
+
+    while (blk) {
+        next = info->chain[blk].pub_next;
+        info->chain[blk].pub_next = 0;
+
+        chain_append(blk);
+        info->pub_ticket++;
+        wake_on_bit(info->put_map, blk)
+
+        blk = next;
+    }
+}
+
+/**
+ * Appends 'n' reserved blocks, whose payloads have already been written, to the chronological chain.
+ * The position of the batch is taken with a single exchange of 'last': the batch is linked to its predecessor right
+ * away, without waiting for the predecessor PUT to complete, since every PUT resets the successor of its blocks before
+ * taking its position and never writes it afterwards.
+ * Only the publication of the blocks to readers follows the order of the batches: each block takes a ticket together
+ * with its place in the chain, and a batch completed before the blocks of the previous tickets is deferred and
+ * published by the PUT that publishes them. The tickets, unlike the blocks, are never reused: the predecessor found
+ * in 'last' may have been published, freed and taken again by a later PUT meanwhile.
+ * For a synchronous PUT, the payloads, every link updated on their behalf and their journal records are written on
+ * the device through a group commit before the batch is published.
+ * The call returns once the batch is published; the buffer heads are released in any case.
+ * */
+int put_new_chain(uint64_t *blks, struct buffer_head **bhs, int n){
+    struct aos_data_block *data_block;
+    struct aos_commit commit, *c = NULL;
+    uint64_t old_last, ticket, pred;
+    u64 start;
+    int i, res = 0, logged = 0;
+
+    /* Each block is detached, appended and possibly given back on failure: one journal record for each step */
+    journal_reserve(3*n);
+
+    /* The chain cannot be relocated while the batch is being linked */
+    start = lat_start();
+    percpu_down_read(&info->relink_sem);
+
+    /* A synchronous PUT dirties its own blocks, their old neighbours (two per block), its predecessor and the journal
+     * blocks of its records (two per block at most) */
+    WB {
+        commit.n = 0;
+        commit.bhs = kmalloc_array(5*n + 1, sizeof(struct buffer_head *), GFP_KERNEL);
+        if (!commit.bhs) {
+            res = -ENOMEM;
+            goto failure;
+        }
+        c = &commit;
+    }
+
+    /* Detach the blocks from the positions they held before being invalidated */
+    for (i = 0; i < n; ++i) {
+        data_block = (struct aos_data_block*)bhs[i]->b_data;
+
+        res = unlink_block(blks[i], data_block, c);
+        logged++;
+        if (res < 0) goto failure;
+
+        info->chain[blks[i]].pub_next = (i == n-1) ? 0 : blks[i+1];
+    }
+
+    /* Take the place after the last block for the whole batch: from now on the batch is part of the chain */
+    journal_lock();
+    old_last = __atomic_exchange_n(&info->last, blks[n-1], __ATOMIC_SEQ_CST);
+    if (old_last == 1) __atomic_store_n(&info->first, blks[0], __ATOMIC_RELAXED);
+    ticket = info->put_ticket;
+    info->put_ticket += n;
+    pred = info->put_tail;
+    info->put_tail = blks[n-1];
+    for (i = 0; i < n; ++i) journal_log(JR_PUT, blks[i], (i == 0) ? old_last : blks[i-1], 0, 0, c);
+    journal_unlock();
+    trace_relink(old_last, blks[n-1], n);
+
+    /* Link the blocks of the batch to each other. The successor of the last one is left to the next PUT */
+    for (i = 0; i < n; ++i) {
+        data_block = (struct aos_data_block*)bhs[i]->b_data;
+
+        write_seqlock(block_lock(blks[i]));
+
+        data_block->metadata.is_valid = 1;
+        data_block->metadata.prev = (i == 0) ? old_last : blks[i-1];
+        if (i < n-1) data_block->metadata.next = blks[i+1];
+
+        mark_buffer_dirty(bhs[i]);
+
+        write_sequnlock(block_lock(blks[i]));
+    }
+
+    /* Link the batch to its predecessor */
+    if (old_last != 1) {
+        write_seqlock(block_lock(old_last));
+        res = change_block_next(old_last, blks[0], c);
+        write_sequnlock(block_lock(old_last));
+    }
+
+    percpu_up_read(&info->relink_sem);
+    lat_end(LAT_RELINK, start);
+
+    /* Write the batch on the device before publishing it */
+    if (c) {
+        for (i = 0; i < n; ++i) c->bhs[c->n++] = get_bh(bhs[i]);
+        if (res == 0) res = commit_put(c);
+        for (i = 0; i < c->n; ++i) brelse(c->bhs[i]);
+        kfree(c->bhs);
+    }
+
+    if (res < 0) {
+        /* The blocks keep their place in the chain as invalid ones, so that the following PUTs stay linked */
+        for (i = 0; i < n; ++i) {
+            write_seqlock(block_lock(blks[i]));
+            ((struct aos_data_block*)bhs[i]->b_data)->metadata.is_valid = 0;
+            mark_buffer_dirty(bhs[i]);
+            write_sequnlock(block_lock(blks[i]));
+        }
+
+        /* The caller gives the blocks back to the free pool: if no PUT followed, 'last' goes back to the predecessor */
+        journal_lock();
+        if (__sync_bool_compare_and_swap(&info->last, blks[n-1], old_last) && old_last == 1)
+            __sync_bool_compare_and_swap(&info->first, blks[0], 0);
+        for (i = n-1; i >= 0; --i) journal_log(JR_FREE, blks[i], (i == 0) ? old_last : blks[i-1], 0, 0, NULL);
+        journal_unlock();
+    } else {
+        journal_release(n);
+    }
+
+    for (i = 0; i < n; ++i) brelse(bhs[i]);
+
+    /* Publish the batch now if every previous ticket is published, otherwise leave it to the PUT of the previous ticket,
+     * whose last block is kept pending, and so not reused, until then */
+    spin_lock(&info->publish_lock);
+    if (info->pub_ticket != ticket) {
+        info->chain[pred].pub_next = blks[0];
+    } else {
+        publish_from(blks[0]);
+    }
+    spin_unlock(&info->publish_lock);
+
+    /* A deferred batch is published anyway, so the wait can be left on a fatal signal; a failed one, instead, must be
+     * published before the caller gives its blocks back */
+    if (test_bit(blks[n-1], info->put_map)) stat_inc(put_waits);
+    start = lat_start();
+    wait_on_bit(info->put_map, blks[n-1], (res < 0) ? TASK_UNINTERRUPTIBLE : TASK_KILLABLE);
+    lat_end(LAT_WAIT, start);
+
+    if (res < 0) {
+        for (i = 0; i < n; ++i) chain_remove(blks[i]);
+    }
+
+    return res;
+
+    failure:
+        percpu_up_read(&info->relink_sem);
+        journal_release(3*n - logged);
+        if (c) {
+            for (i = 0; i < c->n; ++i) brelse(c->bhs[i]);
+            kfree(c->bhs);
+        }
+        for (i = 0; i < n; ++i) {
+            brelse(bhs[i]);
+            wake_on_bit(info->put_map, blks[i])
+        }
         return res;
 }
 
@@ -155,11 +750,18 @@ int invalidate_block(int blk){
     uint64_t prev, next;
     bool is_last = false;
 
-    write_seqlock(&info->block_locks[blk]);
+    journal_reserve(1);
+
+    /* The links of the block cannot be relocated while it is being invalidated */
+    percpu_down_read(&info->relink_sem);
+
+    write_seqlock(block_lock(blk));
 
     fail = get_blk(&bh, info->vfs_sb, blk, &data_block);
     if (fail < 0) {
-        write_sequnlock(&info->block_locks[blk]);
+        write_sequnlock(block_lock(blk));
+        percpu_up_read(&info->relink_sem);
+        journal_release(1);
         return fail;
     }
 
@@ -174,17 +776,498 @@ int invalidate_block(int blk){
     /* - If 'offset' is 'first', change 'first' to 'next'
      * - If 'offset' is 'first' AND 'last', change 'last' to 1
      * - If 'offset' is 'last', change 'last' to 'prev' */
+    journal_lock();
     (__sync_bool_compare_and_swap(&info->first, blk, next)) ?
     __sync_bool_compare_and_swap(&info->last, blk, 1) : (is_last = __sync_bool_compare_and_swap(&info->last, blk, prev));
+    journal_log(JR_INV, blk, prev, next, 0, NULL);
+    journal_unlock();
 
     data_block->metadata.is_valid = 0;
     if (is_last) data_block->metadata.next = 0;
     mark_buffer_dirty(bh);
 
+    chain_remove(blk);
+
 failure:
-    write_sequnlock(&info->block_locks[blk]);
+    write_sequnlock(block_lock(blk));
     brelse(bh);
+    percpu_up_read(&info->relink_sem);
+    if (fail < 0) journal_release(1);
 
     return fail;
 }
 
+/* Chain position of a block in a batch of invalidations */
+struct inv_entry {
+    uint64_t blk;
+    uint64_t prev;
+    uint64_t next;
+    struct buffer_head *bh;
+    struct aos_data_block *data_block;
+    bool done;
+};
+
+static int cmp_inv_entry(const void *a, const void *b){
+    uint64_t x = ((struct inv_entry*)a)->blk;
+    uint64_t y = ((struct inv_entry*)b)->blk;
+
+    return (x > y) - (x < y);
+}
+
+static inline struct inv_entry* find_inv_entry(struct inv_entry *entries, int n, uint64_t blk){
+    struct inv_entry key = { .blk = blk };
+
+    return bsearch(&key, entries, n, sizeof(struct inv_entry), cmp_inv_entry);
+}
+
+/*
+ * Returns the block following 'e' in the run ending with 'end'
+ * */
+static inline struct inv_entry* next_in_run(struct inv_entry *entries, int n, struct inv_entry *e,
+                                            struct inv_entry *end){
+    return (e == end) ? NULL : find_inv_entry(entries, n, e->next);
+}
+
+/*
+ * Invalidates the run of neighbouring blocks going from 'start' to 'end' in the chronological chain, updating
+ * 'first' and 'last' once for the whole run.
+ * The buffers of the run are read first: if one of them cannot be read, the run is cut right before it, so that
+ * 'first' and 'last' only move past the blocks actually invalidated, and the error is stored in 'err'.
+ * @return the number of invalidated blocks
+ * */
+static int invalidate_run(struct inv_entry *entries, int n, struct inv_entry *start, struct inv_entry *end, int *err){
+    struct inv_entry *e, *cut = NULL;
+    bool is_last = false;
+    int count = 0;
+
+    *err = 0;
+    for (e = start; e; e = next_in_run(entries, n, e, end)) {
+        *err = get_blk(&e->bh, info->vfs_sb, e->blk, &e->data_block);
+        if (*err < 0) break;
+        cut = e;
+    }
+    if (!cut) return 0;
+    end = cut;
+
+    /* Same rules of a single invalidation, applied to the run as a whole. Each block gets its own record, with the
+     * surviving neighbours of the run, logged together with the move: replayed one after the other, they lead to the
+     * same 'first' and 'last' */
+    journal_lock();
+    (__sync_bool_compare_and_swap(&info->first, start->blk, end->next)) ?
+    __sync_bool_compare_and_swap(&info->last, end->blk, 1) : (is_last = __sync_bool_compare_and_swap(&info->last, end->blk, start->prev));
+    for (e = start; e; e = next_in_run(entries, n, e, end)) journal_log(JR_INV, e->blk, start->prev, e->next, 0, NULL);
+    journal_unlock();
+
+    for (e = start; e; e = next_in_run(entries, n, e, end)) {
+        write_seqlock(block_lock(e->blk));
+
+        e->data_block->metadata.is_valid = 0;
+        if (is_last && e == end) e->data_block->metadata.next = 0;
+        mark_buffer_dirty(e->bh);
+
+        chain_remove(e->blk);
+
+        write_sequnlock(block_lock(e->blk));
+        brelse(e->bh);
+
+        e->done = true;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Invalidates a batch of 'n' blocks, whose bits in INV_MAP are held by the caller.
+ * The blocks that are neighbours in the chronological chain are grouped into runs, so that 'first' and 'last' are
+ * moved once per run, directly to the surviving neighbours, instead of once per invalidated block.
+ * On return, the first entries of 'blks' are the blocks actually invalidated, followed by the ones that were not.
+ * The batch is made of MAX_VEC blocks at most, each logging one journal record.
+ * @return the number of invalidated blocks, even if a run stopped early; the error that stopped it if none was
+ * */
+int invalidate_blocks(uint64_t *blks, int n){
+    struct aos_db_metadata metadata;
+    struct inv_entry *entries, *start, *end, *e;
+    uint64_t tmp;
+    int i, j, m, res, err, steps, count = 0, logged = 0;
+
+    entries = kvmalloc_array(n, sizeof(struct inv_entry), GFP_KERNEL);
+    if (!entries) return -ENOMEM;
+
+    journal_reserve(n);
+
+    /* The chain positions retrieved below cannot be relocated until the batch is invalidated */
+    percpu_down_read(&info->relink_sem);
+
+    /* Retrieve the chain position of each block that currently keeps valid data */
+    for (i = 0, m = 0; i < n; ++i) {
+        res = cpy_blk(info->vfs_sb, block_lock(blks[i]), blks[i], sizeof(metadata),
+                      (struct aos_data_block*)&metadata);
+        if (res < 0 || !metadata.is_valid) continue;
+
+        entries[m].blk = blks[i];
+        entries[m].prev = metadata.prev;
+        entries[m].next = metadata.next;
+        entries[m].done = false;
+        m++;
+    }
+
+    sort(entries, m, sizeof(struct inv_entry), cmp_inv_entry, NULL);
+
+    /* Each block whose predecessor is not in the batch starts a run: follow it up to its last block.
+     * A second pass handles, as single runs, the blocks that a stale link kept out of every run. */
+    for (i = 0; i < 2*m; ++i) {
+        start = &entries[i % m];
+        if (start->done || (i < m && find_inv_entry(entries, m, start->prev))) continue;
+
+        end = start;
+        for (steps = 1; i < m && steps < m && end->next != 0; ++steps) {
+            e = find_inv_entry(entries, m, end->next);
+            if (!e || e->done) break;
+            end = e;
+        }
+
+        count += invalidate_run(entries, m, start, end, &err);
+        if (err < 0) {
+            if (!count) count = err;
+            break;
+        }
+    }
+
+    /* Report the invalidated blocks first */
+    for (i = 0, j = 0; i < n && count > 0; ++i) {
+        e = find_inv_entry(entries, m, blks[i]);
+        if (!e || !e->done) continue;
+
+        tmp = blks[j];
+        blks[j++] = blks[i];
+        blks[i] = tmp;
+    }
+
+    percpu_up_read(&info->relink_sem);
+
+    for (i = 0; i < m; ++i) logged += entries[i].done;
+    journal_release(n - logged);
+
+    kvfree(entries);
+    return count;
+}
+/*
+ * Checks whether the block 'blk' is linked in the in-memory chain, i.e. it keeps a valid published message.
+ * */
+static bool chain_linked(uint64_t blk){
+    unsigned int seq;
+    uint64_t prev;
+    bool linked;
+
+    do {
+        seq = read_seqbegin(&info->chain_lock);
+        prev = info->chain[blk].prev;
+        linked = prev ? (info->chain[prev].next == blk) : (info->chain_first == blk);
+    } while (read_seqretry(&info->chain_lock, seq));
+
+    return linked;
+}
+
+/*
+ * Puts the block 'dst' in place of the block 'src' in the in-memory chain. The successor of 'src' becomes 'dst', so
+ * that a reader currently positioned on 'src' moves on to the relocated message.
+ * */
+static void chain_replace(uint64_t src, uint64_t dst){
+    uint64_t prev, next;
+
+    write_seqlock(&info->chain_lock);
+
+    info->chain[dst] = info->chain[src];
+    prev = info->chain[dst].prev;
+    next = info->chain[dst].next;
+
+    if (prev) {
+        info->chain[prev].next = dst;
+    } else {
+        info->chain_first = dst;
+    }
+    if (next) {
+        info->chain[next].prev = dst;
+    } else {
+        info->chain_last = dst;
+    }
+    info->chain[src].next = dst;
+
+    write_sequnlock(&info->chain_lock);
+}
+
+/*
+ * Counts the hops of the in-memory chain between blocks that are not consecutive on the device, i.e. the seeks of a
+ * full read of the device.
+ * */
+static uint64_t chain_breaks(void){
+    uint64_t blk, next, breaks = 0;
+
+    for (blk = chain_next(0); blk != 0; blk = next) {
+        next = chain_next(blk);
+        if (next != 0 && next != blk + 1) breaks++;
+    }
+
+    return breaks;
+}
+
+/*
+ * Moves the message kept by the valid block 'src' to the block 'dst', whose bit in the free blocks bitmap is held by
+ * the caller, so that 'dst' takes the place of 'src' in the chain, both on the device and in memory.
+ * Called with 'relink_sem' held for writing: no PUT or invalidation can update the links meanwhile, while readers
+ * keep running under the seqlocks of the blocks. 'src' is left invalid and detached, still taken in the bitmap.
+ * The copy is written on the device before the move is logged, so that a replayed move never leads to a block that
+ * did not reach the device. The journal records logged, out of the ones reserved by the caller, are added to 'logged'.
+ * Once it returns 0 the move is published, and the neighbours of 'src', stored in 'prev' and 'next', still have to be
+ * pointed to 'dst' with 'relink_moved'.
+ * @return 0 if the message was moved; the error that left it in 'src' otherwise
+ * */
+static int relocate_block(uint64_t src, uint64_t dst, uint64_t *prev, uint64_t *next, int *logged){
+    struct buffer_head *bh_src, *bh_dst;
+    struct aos_data_block *db_src, *db_dst;
+    int res;
+
+    res = get_blk(&bh_dst, info->vfs_sb, dst, &db_dst);
+    if (res < 0) return res;
+
+    /* Detach the destination from the position it held before being invalidated */
+    res = unlink_block(dst, db_dst, NULL);
+    (*logged)++;
+    if (res < 0) goto failure_1;
+
+    res = get_blk(&bh_src, info->vfs_sb, src, &db_src);
+    if (res < 0) goto failure_1;
+
+    if (!db_src->metadata.is_valid) {
+        res = -ENODATA;
+        goto failure_2;
+    }
+
+    /* The message, its length and its links are copied as they are */
+    *prev = db_src->metadata.prev;
+    *next = db_src->metadata.next;
+
+    write_seqlock(block_lock(dst));
+    memcpy(db_dst, db_src, sizeof(struct aos_data_block));
+    mark_buffer_dirty(bh_dst);
+    write_sequnlock(block_lock(dst));
+
+    res = sync_dirty_buffer(bh_dst);
+    if (res < 0) {
+        /* The copy must not relink the neighbours of 'src' when the block is reused */
+        write_seqlock(block_lock(dst));
+        db_dst->metadata.is_valid = 0;
+        db_dst->metadata.next = 0;
+        mark_buffer_dirty(bh_dst);
+        write_sequnlock(block_lock(dst));
+        goto failure_2;
+    }
+
+    write_seqlock(block_lock(src));
+
+    db_src->metadata.is_valid = 0;
+    db_src->metadata.next = 0; // detached: a later reuse must not relink anything
+    mark_buffer_dirty(bh_src);
+
+    chain_replace(src, dst);
+
+    write_sequnlock(block_lock(src));
+    brelse(bh_src);
+    brelse(bh_dst);
+
+    journal_lock();
+    __sync_bool_compare_and_swap(&info->first, src, dst);
+    __sync_bool_compare_and_swap(&info->last, src, dst);
+    journal_log(JR_MOVE, dst, *prev, *next, src, NULL);
+    journal_unlock();
+    (*logged)++;
+
+    return 0;
+
+    failure_2:
+        brelse(bh_src);
+    failure_1:
+        brelse(bh_dst);
+        return res;
+}
+
+/*
+ * Makes the neighbours 'prev' and 'next' of a message moved by 'relocate_block' point to its new position 'dst' on
+ * the device. The move is published whatever the outcome: on failure the in-memory chain is still right, while the
+ * device keeps the old link until the logged move is replayed, or the state is recovered from the blocks.
+ * */
+static int relink_moved(uint64_t dst, uint64_t prev, uint64_t next){
+    int res = 0;
+
+    if (prev != 1) {
+        write_seqlock(block_lock(prev));
+        res = change_block_next(prev, dst, NULL);
+        write_sequnlock(block_lock(prev));
+    }
+    if (res == 0 && next != 0) {
+        write_seqlock(block_lock(next));
+        res = change_block_prev(next, dst, NULL);
+        write_sequnlock(block_lock(next));
+    }
+    if (res < 0) {
+        printk(KERN_ALERT "%s: [relink_moved()] couldn't link the neighbours of block %llu to its new position\n",
+               MODNAME, dst);
+    }
+
+    return res;
+}
+
+/*
+ * Takes a free block after 'start' to move a message out of the way of the compaction.
+ * @return the index of the block; 0 if there is none
+ * */
+static uint64_t take_spare_block(uint64_t start, uint64_t nblocks){
+    uint64_t blk;
+
+    for (blk = find_free_block(start, nblocks); blk < nblocks; blk = find_free_block(blk + 1, nblocks)) {
+        if (!take_block(blk)) return blk;
+    }
+
+    return 0;
+}
+
+/**
+ * Relocates the valid messages so that the chain is laid out on consecutive blocks from the beginning of the data
+ * area, in chronological order, and a full read of the device becomes a sequential scan.
+ * The chain is followed from its first block while a target position moves forward over the device: each message
+ * found out of place is moved to the target position, after moving away the message that possibly occupies it.
+ * The positions taken by pending PUTs are skipped.
+ * Relocations run in batches of COMPACT_BATCH with 'relink_sem' held for writing, so that PUTs and invalidations
+ * wait for one batch at most, while readers are never stopped.
+ * Relocated messages change their offset: each relocation is stored in 'moves', and the compaction stops once 'max'
+ * relocations are done. The old offsets are left invalid but taken, so that no PUT reuses them before the caller has
+ * handed the map over and given them back with 'release_moved'; the positions freed this way are compacted by a later
+ * run. The moves done are stored even if a relocation fails, including the one whose neighbours couldn't be relinked.
+ * @return 0 on success, with the outcome in 'stats'; the error of the relocation that stopped the compaction otherwise.
+ * */
+int compact_chain(struct aos_compact_stats *stats, struct aos_compact_move *moves, uint64_t max){
+    uint64_t nblocks = info->sb.partition_size;
+    uint64_t blk, target, spare, prev, next;
+    bool occupied = false;
+    int res = 0, batch = 0, logged = 0;
+
+    stats->moved = 0;
+    stats->breaks_before = chain_breaks();
+
+    /* A batch ends with two relocations at most beyond COMPACT_BATCH, each logging two journal records */
+    journal_reserve(2 * (COMPACT_BATCH + 1));
+    percpu_down_write(&info->relink_sem);
+
+    blk = chain_next(0);
+    target = 2;
+    while (blk != 0 && target < nblocks && stats->moved + 2 <= max) { // room for the moves of one more position
+        /* Let the PUTs and the invalidations waiting for the chain run */
+        if (batch >= COMPACT_BATCH) {
+            percpu_up_write(&info->relink_sem);
+            journal_release(2 * (COMPACT_BATCH + 1) - logged);
+            cond_resched();
+            journal_reserve(2 * (COMPACT_BATCH + 1));
+            percpu_down_write(&info->relink_sem);
+            batch = logged = 0;
+
+            /* Meanwhile the block may have been invalidated: it still leads to its successor */
+            if (!chain_linked(blk)) {
+                blk = chain_next(blk);
+                continue;
+            }
+        }
+
+        if (blk == target) {
+            blk = chain_next(blk);
+            target++;
+            continue;
+        }
+
+        /* A message being invalidated is left where it is. Otherwise the INV bit is held until it is moved, so that
+         * invalidations of its old offset fail as for any other invalid block */
+        if (test_and_set_bit(blk, info->inv_map)) {
+            blk = chain_next(blk);
+            continue;
+        }
+
+        if (take_block(target)) {
+            /* Skip the position if it is not taken by a valid message (a PUT is pending on it) or if the message
+             * is being invalidated */
+            if (!chain_linked(target) || test_and_set_bit(target, info->inv_map)) {
+                clear_bit(blk, info->inv_map);
+                target++;
+                continue;
+            }
+
+            /* Otherwise make room for the message, moving the one in place forward */
+            spare = take_spare_block(target + 1, nblocks);
+            res = (spare != 0) ? relocate_block(target, spare, &prev, &next, &logged) : 0;
+            if (spare == 0 || res < 0) { // no room left to move messages around, or the relocation failed
+                if (spare) free_block(spare);
+                clear_bit(target, info->inv_map);
+                clear_bit(blk, info->inv_map);
+                break;
+            }
+            moves[stats->moved].from = target;
+            moves[stats->moved].to = spare;
+            stats->moved++;
+            batch++;
+
+            /* From now on the message is kept by the spare block, even if its neighbours still lead to the target */
+            res = relink_moved(spare, prev, next);
+            if (res < 0) {
+                clear_bit(target, info->inv_map);
+                clear_bit(blk, info->inv_map);
+                break;
+            }
+            occupied = true;
+        }
+
+        /* The target position is now held: move the message there. The INV bit of the position is kept until then,
+         * so that a late invalidation of the message that was there cannot hit the one moved in */
+        res = relocate_block(blk, target, &prev, &next, &logged);
+        if (occupied) clear_bit(target, info->inv_map);
+        if (res < 0) {
+            if (!occupied) free_block(target); // otherwise it is the old offset of a move, given back with the others
+            clear_bit(blk, info->inv_map);
+            break;
+        }
+        occupied = false;
+        clear_bit(blk, info->inv_map);
+        moves[stats->moved].from = blk;
+        moves[stats->moved].to = target;
+        stats->moved++;
+        batch++;
+
+        res = relink_moved(target, prev, next);
+        if (res < 0) break;
+
+        blk = chain_next(target);
+        target++;
+    }
+
+    percpu_up_write(&info->relink_sem);
+    journal_release(2 * (COMPACT_BATCH + 1) - logged);
+
+    stats->breaks_after = chain_breaks();
+
+    AUDIT { printk(KERN_INFO "%s: [compact_chain() - %d] Relocated %llu messages, chain breaks from %llu to %llu\n",
+                   MODNAME, current->pid, stats->moved, stats->breaks_before, stats->breaks_after); }
+
+    return res;
+}
+
+/**
+ * Gives back the old offsets of the 'n' relocations in 'moves' done by 'compact_chain', once their map has been
+ * handed over. An old offset taken again by the following move, where the message of the compaction was put in place
+ * of the one moved away, is kept.
+ * */
+void release_moved(struct aos_compact_move *moves, uint64_t n){
+    uint64_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (i + 1 < n && moves[i + 1].to == moves[i].from) continue;
+        free_block(moves[i].from);
+    }
+}